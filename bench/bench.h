@@ -0,0 +1,53 @@
+#ifndef clox_bench_h
+#define clox_bench_h
+
+// The little bits every benchmark in here needs. They're all separate programs with their own main(), so this is header only.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+// Nanoseconds from some fixed point in the past. Only good for measuring how long something took.
+static inline double benchNow(void) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC); // C11, so it works on Windows too. Not monotonic, but nothing here runs long enough for that to matter.
+    return (double)now.tv_sec * 1e9 + (double)now.tv_nsec;
+}
+
+// Every Lox program prints its result, and printing would swamp what's being measured, so the benchmarks send stdout nowhere.
+// Results go to stderr instead.
+static inline void silenceStdout(void) {
+    if (freopen(NULL_DEVICE, "w", stdout) == NULL) {
+        fprintf(stderr, "Could not open %s.\n", NULL_DEVICE);
+        exit(74);
+    }
+}
+
+static inline char* benchReadFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+
+    fseek(file, 0L, SEEK_END);
+    size_t size = (size_t)ftell(file);
+    rewind(file);
+
+    char* buffer = (char*)malloc(size + 1);
+    if (buffer == NULL || fread(buffer, sizeof(char), size, file) < size) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
+    buffer[size] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+#endif
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "hash.h"
+
+/*
+  hashString() against the FNV-1a it replaced, on the two kinds of strings that matter: short identifiers (what the intern table sees most)
+  and strings of a few KB (long concatenations). Short ones report ns per hash, long ones GB/s.
+
+  Usage: hash [rounds]
+*/
+
+// The old hash, kept here so there's something to compare against
+static uint32_t fnv1a(const char* key, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+#define IDENTIFIERS 4096
+#define LONG_SIZE (64 * 1024)
+
+static uint64_t secret[HASH_SECRET_WORDS];
+static volatile uint32_t sink; // Every hash gets folded into this, so the compiler can't throw the work away
+
+// Identifier-like strings of 3 to 12 characters, all stored back to back
+static char* makeIdentifiers(int* lengths, int* offsets) {
+    char* characters = (char*)malloc(IDENTIFIERS * 12);
+    int offset = 0;
+    srand(1);
+    for (int i = 0; i < IDENTIFIERS; i++) {
+        lengths[i] = 3 + rand() % 10;
+        offsets[i] = offset;
+        for (int j = 0; j < lengths[i]; j++) characters[offset++] = "abcdefghijklmnopqrstuvwxyz_0123456789"[rand() % 37];
+    }
+    return characters;
+}
+
+static void benchIdentifiers(int rounds) {
+    int lengths[IDENTIFIERS];
+    int offsets[IDENTIFIERS];
+    char* characters = makeIdentifiers(lengths, offsets);
+
+    uint32_t total = 0;
+    double start = benchNow();
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < IDENTIFIERS; i++) total ^= fnv1a(characters + offsets[i], lengths[i]);
+    }
+    double old = (benchNow() - start) / ((double)rounds * IDENTIFIERS);
+
+    start = benchNow();
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < IDENTIFIERS; i++) total ^= hashString(secret, characters + offsets[i], lengths[i]);
+    }
+    double current = (benchNow() - start) / ((double)rounds * IDENTIFIERS);
+
+    sink = total;
+    fprintf(stderr, "3-12 byte identifiers\n  FNV-1a       %6.2f ns/hash\n  hashString() %6.2f ns/hash\n", old, current);
+    free(characters);
+}
+
+static void benchLong(int rounds) {
+    char* characters = (char*)malloc(LONG_SIZE);
+    for (int i = 0; i < LONG_SIZE; i++) characters[i] = (char)('a' + i % 26);
+
+    fprintf(stderr, "Long strings (GB/s)     FNV-1a  hashString()\n");
+    for (int size = 2 * 1024; size <= LONG_SIZE; size *= 2) {
+        int repeats = rounds * 32 * 1024 / size + 1; // About the same number of bytes for every size
+        uint32_t total = 0;
+
+        double start = benchNow();
+        for (int i = 0; i < repeats; i++) total ^= fnv1a(characters, size - (i & 1)); // Alternating lengths so the calls can't be merged
+        double old = (double)size * repeats / (benchNow() - start);
+
+        start = benchNow();
+        for (int i = 0; i < repeats; i++) total ^= hashString(secret, characters, size - (i & 1));
+        double current = (double)size * repeats / (benchNow() - start);
+
+        sink = total;
+        fprintf(stderr, "  %6d bytes        %8.2f  %8.2f\n", size, old, current);
+    }
+    free(characters);
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+    if (rounds <= 0) {
+        fprintf(stderr, "Usage: hash [rounds]\n");
+        return 64;
+    }
+
+    seedHash(secret);
+    benchIdentifiers(rounds);
+    benchLong(rounds);
+    return 0;
+}
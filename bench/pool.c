@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "memory.h"
+#include "vm.h"
+
+/*
+  Allocation-heavy work, for comparing the pool allocator (pool.c) with plain malloc. "make bench-pool" builds this twice, once with
+  POOL_ALLOCATOR and once with -DNO_POOL_ALLOCATOR, and runs both, so the two sets of numbers come out one after the other.
+  There are two kinds of work:
+    - compiling: interpret() on a mix of programs, so every run allocates and frees a chunk, its arrays, its constants and a Program
+    - strings: prepared programs that build strings at runtime, so every run makes ropes and strings that the GC then frees
+  The second needs NO_CONSTANT_FOLDING, or the compiler builds every string itself and the runs allocate nothing.
+  Each one is timed REPEATS times and reports the fastest and the median, since allocator differences are small next to the noise.
+
+  Usage: pool [iterations]
+*/
+#ifndef NO_CONSTANT_FOLDING
+#error "bench/pool.c needs -DNO_CONSTANT_FOLDING, or its string programs fold into constants and never allocate"
+#endif
+
+#define REPEATS 9
+
+static const char* compiled[] = {
+    "1 + 2 * 3 - 4 / (5 - 6)",
+    "(1 + 2) * 3 - 4 / (5 - 6) > 7 == !(8 <= 9)",
+    "\"price: \" + \"12\" + \" USD\" == \"price: 12 USD\"",
+    "\"one\" + \"two\" + \"three\" + \"four\" + \"five\" + \"six\" + \"seven\" + \"eight\"",
+    "!(nil == false) == (\"a\" != \"b\")",
+    "-(-(-(-(1.5)))) * 2 + 3 * 4 - 5 / 6 + 7 * 8 - 9",
+};
+
+// Lots of small strings: each + makes a new one, and most of them are garbage by the end of the run
+static const char* strings[] = {
+    "(\"key\" + \"=\") + (\"value\" + \";\") + (\"other\" + \"=\") + (\"thing\" + \";\")",
+    "((\"a\" + \"b\") + (\"c\" + \"d\")) + ((\"e\" + \"f\") + (\"g\" + \"h\")) == \"abcdefgh\"",
+    "(\"The quick brown fox \" + \"jumps over \") + (\"the lazy dog \" + \"again and again \") + (\"and again.\" + \"\")",
+};
+
+#define COUNT(array) ((int)(sizeof(array) / sizeof((array)[0])))
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char* name, double* times, VM* vm) {
+    qsort(times, REPEATS, sizeof(double), compareDoubles);
+    MemoryStats stats;
+    getMemoryStats(vm, &stats);
+    fprintf(stderr, "  %-10s min %8.1f ns  median %8.1f ns  (%d collections, %zu KB pool)\n",
+            name, times[0], times[REPEATS / 2], stats.gcCount, stats.poolBytes / 1024);
+}
+
+// ns per interpret(), over all of "compiled"
+static void benchCompiling(int iterations) {
+    VM vm;
+    initVM(&vm);
+    double times[REPEATS];
+    for (int repeat = 0; repeat < REPEATS; repeat++) {
+        double start = benchNow();
+        for (int i = 0; i < iterations; i++) interpret(&vm, compiled[i % COUNT(compiled)]);
+        times[repeat] = (benchNow() - start) / iterations;
+    }
+    report("compiling", times, &vm);
+    freeVM(&vm);
+}
+
+// ns per runProgram(), over all of "strings"
+static void benchStrings(int iterations) {
+    VM vm;
+    initVM(&vm);
+    Program* programs[COUNT(strings)];
+    for (int i = 0; i < COUNT(strings); i++) {
+        programs[i] = prepare(&vm, strings[i]);
+        if (programs[i] == NULL) {
+            fprintf(stderr, "Could not compile \"%s\".\n", strings[i]);
+            exit(65);
+        }
+    }
+
+    double times[REPEATS];
+    for (int repeat = 0; repeat < REPEATS; repeat++) {
+        double start = benchNow();
+        for (int i = 0; i < iterations; i++) runProgram(&vm, programs[i % COUNT(strings)]);
+        times[repeat] = (benchNow() - start) / iterations;
+    }
+    report("strings", times, &vm);
+
+    for (int i = 0; i < COUNT(strings); i++) freeProgram(&vm, programs[i]);
+    freeVM(&vm);
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    if (iterations <= 0) {
+        fprintf(stderr, "Usage: pool [iterations]\n");
+        return 64;
+    }
+
+    silenceStdout();
+#ifdef POOL_ALLOCATOR
+    fprintf(stderr, "Pool allocator:\n");
+#else
+    fprintf(stderr, "malloc:\n");
+#endif
+    benchCompiling(iterations);
+    benchStrings(iterations);
+    return 0;
+}
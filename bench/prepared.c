@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "vm.h"
+
+/*
+  How long one evaluation takes through interpret() (scan, compile, run and free every time) versus a program that was prepare()d once
+  and is just runProgram()'d over and over. The difference is what the prepared program API saves per evaluation.
+
+  Usage: prepared [iterations]
+*/
+
+// Expressions that stress different parts: arithmetic and comparisons, and strings (which intern their result on every run)
+static const char* sources[] = {
+    "(1 + 2) * 3 - 4 / (5 - 6) > 7 == !(8 <= 9)",
+    "\"price: \" + \"12\" + \" USD\" == \"price: 12 USD\"",
+};
+
+static double timeInterpret(VM* vm, const char* source, int iterations) {
+    double start = benchNow();
+    for (int i = 0; i < iterations; i++) interpret(vm, source);
+    return (benchNow() - start) / iterations;
+}
+
+static double timePrepared(VM* vm, const char* source, int iterations) {
+    Program* program = prepare(vm, source);
+    if (program == NULL) {
+        fprintf(stderr, "Could not compile \"%s\".\n", source);
+        exit(65);
+    }
+
+    double start = benchNow();
+    for (int i = 0; i < iterations; i++) runProgram(vm, program);
+    double perRun = (benchNow() - start) / iterations;
+
+    freeProgram(vm, program);
+    return perRun;
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+    if (iterations <= 0) {
+        fprintf(stderr, "Usage: prepared [iterations]\n");
+        return 64;
+    }
+
+    silenceStdout();
+    VM vm;
+    initVM(&vm);
+
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        // Each one warms up first, so the first timing doesn't pay for the stack, the string table and the pool growing
+        timeInterpret(&vm, sources[i], iterations / 10 + 1);
+        double interpreted = timeInterpret(&vm, sources[i], iterations);
+        double prepared = timePrepared(&vm, sources[i], iterations);
+        fprintf(stderr, "%s\n  interpret()  %8.1f ns\n  runProgram() %8.1f ns  (%.1fx)\n",
+                sources[i], interpreted, prepared, interpreted / prepared);
+    }
+
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "vm.h"
+
+/*
+  The register backend against the stack VM. "make bench-registers" builds this twice, with and without REGISTER_VM, and runs both on
+  the same programs. For each program it reports:
+    - how many instructions it is as stack code, and (in the REGISTER_VM build) as register code. Programs have no jumps, so that's
+      also how many instructions every run dispatches.
+    - how long one run takes, preparing once and then running it over and over. Fastest of REPEATS.
+  Build with NO_CONSTANT_FOLDING, or programs made of literals fold down to a single constant and there's nothing left to compare.
+  Programs that don't run cleanly are skipped, since the error path isn't what's being measured.
+
+  Usage: registers [-n iterations] files...
+*/
+#define REPEATS 11
+
+// How many bytes the stack instruction at the start of "code" takes up
+static int instructionLength(const uint8_t* code) {
+    switch (*code) {
+        case OP_CONSTANT_LONG: return 4;
+        case OP_CONSTANT:
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT:
+        case OP_MULTIPLY_CONSTANT:
+        case OP_DIVIDE_CONSTANT:
+        case OP_ADD_CONSTANT_NUM:
+        case OP_SUBTRACT_CONSTANT_NUM:
+        case OP_MULTIPLY_CONSTANT_NUM:
+        case OP_DIVIDE_CONSTANT_NUM:
+        case OP_CONCAT:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+static int countInstructions(Chunk* chunk) {
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code + offset)) count++;
+    return count;
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = 2000;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        iterations = atoi(argv[2]);
+        first = 3;
+    }
+    if (iterations <= 0 || first >= argc) {
+        fprintf(stderr, "Usage: registers [-n iterations] files...\n");
+        return 64;
+    }
+
+    silenceStdout();
+    VM vm;
+    initVM(&vm);
+#ifdef REGISTER_VM_ENABLED
+    fprintf(stderr, "Register VM                        stack instrs  register instrs       ns/run\n");
+#else
+    fprintf(stderr, "Stack VM                           stack instrs       ns/run\n");
+#endif
+
+    long stackTotal = 0;
+    long registerTotal = 0;
+    double timeTotal = 0;
+    for (int i = first; i < argc; i++) {
+        char* source = benchReadFile(argv[i]);
+        Program* program = prepare(&vm, source);
+        free(source);
+        // The first run is also the warmup: it quickens the code, and sizes the stack and the string table
+        if (program == NULL || runProgram(&vm, program) != INTERPRET_OK) {
+            fprintf(stderr, "  %s doesn't run cleanly, skipped\n", argv[i]);
+            if (program != NULL) freeProgram(&vm, program);
+            continue;
+        }
+
+        double best = 0;
+        for (int repeat = 0; repeat < REPEATS; repeat++) {
+            double start = benchNow();
+            for (int run = 0; run < iterations; run++) runProgram(&vm, program);
+            double perRun = (benchNow() - start) / iterations;
+            if (repeat == 0 || perRun < best) best = perRun;
+        }
+
+        int stackCount = countInstructions(&program->chunk);
+        stackTotal += stackCount;
+        timeTotal += best;
+#ifdef REGISTER_VM_ENABLED
+        // Zero means it couldn't be translated and the stack code ran instead
+        registerTotal += program->chunk.registerCount;
+        fprintf(stderr, "  %-32s %12d  %15d  %11.1f\n", argv[i], stackCount, program->chunk.registerCount, best);
+#else
+        fprintf(stderr, "  %-32s %12d  %11.1f\n", argv[i], stackCount, best);
+#endif
+        freeProgram(&vm, program);
+    }
+
+#ifdef REGISTER_VM_ENABLED
+    fprintf(stderr, "  %-32s %12ld  %15ld  %11.1f  (%.1f%% fewer instructions)\n", "total", stackTotal, registerTotal, timeTotal,
+            stackTotal == 0 ? 0.0 : 100.0 * (double)(stackTotal - registerTotal) / (double)stackTotal);
+#else
+    (void)registerTotal;
+    fprintf(stderr, "  %-32s %12ld  %11.1f\n", "total", stackTotal, timeTotal);
+#endif
+    freeVM(&vm);
+    return 0;
+}
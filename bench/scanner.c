@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "scanner.h"
+
+/*
+  Scanning on its own, with no compiler behind it: initScanner() and then scanToken() until TOKEN_EOF, over and over. By default the
+  input is generated here, and is as hard on identifierType() as a real script could be: nothing but words, about 35% of them keywords,
+  and most of the rest near misses that share a keyword's first letter, last letter or length ("classy", "nill", "whiles", "fo"), so the
+  keyword hash hits a slot and has to compare. Given a file, it scans that instead.
+
+  Usage: scanner [passes] [file]
+*/
+#define WORDS 700000
+#define PASSES 21
+
+static const char* keywords[] = {
+    "and", "class", "else", "false", "for", "fun", "if", "nil", "or", "print", "return", "super", "this", "true", "var", "while",
+};
+static const char* others[] = {
+    // Near misses
+    "an", "ands", "classy", "els", "fals", "fort", "funny", "iff", "nill", "orr", "prints", "returned", "sup", "th", "tru", "va", "whiles",
+    // Plain identifiers
+    "i", "x", "_", "A", "Z9", "foo", "total", "counter", "bar_baz", "snake_case_name_here", "thisIsALongerCamelCaseName",
+};
+#define COUNT(array) ((int)(sizeof(array) / sizeof((array)[0])))
+
+// Words separated by spaces, with a newline after about one word in four. Seeded, so every run scans the same thing.
+static char* generateSource(void) {
+    size_t capacity = (size_t)WORDS * 32;
+    char* source = (char*)malloc(capacity);
+    if (source == NULL) exit(1);
+
+    size_t length = 0;
+    srand(1);
+    for (int i = 0; i < WORDS; i++) {
+        const char* word = rand() % 100 < 35 ? keywords[rand() % COUNT(keywords)] : others[rand() % COUNT(others)];
+        size_t wordLength = strlen(word);
+        memcpy(source + length, word, wordLength);
+        length += wordLength;
+        source[length++] = rand() % 4 == 0 ? '\n' : ' ';
+    }
+    source[length] = '\0';
+    return source;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char* argv[]) {
+    int passes = argc > 1 ? atoi(argv[1]) : PASSES;
+    if (passes <= 0) {
+        fprintf(stderr, "Usage: scanner [passes] [file]\n");
+        return 64;
+    }
+    char* source = argc > 2 ? benchReadFile(argv[2]) : generateSource();
+    size_t size = strlen(source);
+
+    // One pass first to count what's in there, which also gets the source into the cache
+    int tokens = 0;
+    int keywordTokens = 0;
+    Scanner scanner;
+    initScanner(&scanner, source);
+    for (Token token = scanToken(&scanner); token.type != TOKEN_EOF; token = scanToken(&scanner)) {
+        tokens++;
+        if (token.type >= TOKEN_AND && token.type <= TOKEN_WHILE) keywordTokens++;
+    }
+
+    double* times = (double*)malloc(sizeof(double) * (size_t)passes);
+    if (times == NULL) exit(1);
+    int check = 0; // The token types get added up, so the compiler can't decide the scanning does nothing
+    for (int pass = 0; pass < passes; pass++) {
+        double start = benchNow();
+        initScanner(&scanner, source);
+        Token token;
+        do {
+            token = scanToken(&scanner);
+            check += (int)token.type;
+        } while (token.type != TOKEN_EOF);
+        times[pass] = benchNow() - start;
+    }
+    qsort(times, (size_t)passes, sizeof(double), compareDoubles);
+
+    fprintf(stderr, "%s: %.1f MB, %d tokens (%.0f%% keywords)\n", argc > 2 ? argv[2] : "generated identifiers",
+            (double)size / 1e6, tokens, tokens == 0 ? 0.0 : 100.0 * keywordTokens / tokens);
+    fprintf(stderr, "  min %.2f ms  median %.2f ms per pass  (%.0f MB/s)\n",
+            times[0] / 1e6, times[passes / 2] / 1e6, (double)size / times[passes / 2] * 1e3);
+
+    free(times);
+    free(source);
+    return check == 42; // Never is, but it keeps "check" alive
+}
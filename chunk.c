@@ -2,36 +2,94 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
 
 void initChunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
+    chunk->maxStack = 0;
+#ifdef REGISTER_VM_ENABLED
+    chunk->registerCode = NULL;
+    chunk->registerOrigins = NULL;
+    chunk->registerCount = 0;
+#endif
     initValueArray(&chunk->constants);
 }
 
-void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+void freeChunk(VM* vm, Chunk* chunk) {
+    FREE_ARRAY(vm, MEM_CODE, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, MEM_LINES, LineStart, chunk->lines, chunk->lineCapacity);
+    freeValueArray(vm, &chunk->constants);
+#ifdef REGISTER_VM_ENABLED
+    freeRegisterCode(vm, chunk);
+#endif
     initChunk(chunk);
 }
 
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+#ifdef REGISTER_VM_ENABLED
+void freeRegisterCode(VM* vm, Chunk* chunk) {
+    FREE_ARRAY(vm, MEM_CODE, RegisterInstruction, chunk->registerCode, chunk->registerCount);
+    FREE_ARRAY(vm, MEM_CODE, int, chunk->registerOrigins, chunk->registerCount);
+    chunk->registerCode = NULL;
+    chunk->registerOrigins = NULL;
+    chunk->registerCount = 0;
+}
+#endif
+
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, MEM_CODE, uint8_t, chunk->code, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    // The compiler sometimes throws away code from the end of the chunk (see discardCode()), which can leave runs behind that start past the end
+    while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= chunk->count - 1) {
+        chunk->lineCount--;
+    }
+
+    // Still on the same line, so the last run just gets longer
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) return;
+
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(vm, MEM_LINES, LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+
+    LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+    lineStart->offset = chunk->count - 1;
+    lineStart->line = line;
 }
 
-int addConstant(Chunk* chunk, Value value) {
-    writeValueArray(&chunk->constants, value);
+int addConstant(VM* vm, Chunk* chunk, Value value) {
+    push(vm, value); // Growing the constant pool can trigger a collection, and the value isn't reachable from anywhere yet
+    writeValueArray(vm, &chunk->constants, value);
+    pop(vm);
     return chunk->constants.count - 1; // Returns -1 because writeValueArray increments count
+}
+
+// Finds the line of the instruction at "offset" with a binary search for the last run that starts at or before it
+int getLine(Chunk* chunk, int offset) {
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    int line = 0;
+
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        if (chunk->lines[middle].offset <= offset) {
+            line = chunk->lines[middle].line;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return line;
 }
\ No newline at end of file
@@ -4,8 +4,11 @@
 #include "common.h"
 #include "value.h"
 
+#define MAX_CONSTANTS (1 << 24) // OP_CONSTANT_LONG's operand is 24 bits
+
 typedef enum {
     OP_CONSTANT,
+    OP_CONSTANT_LONG, // Same as OP_CONSTANT, but with a 24-bit operand for pools with more than 256 constants
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
@@ -19,19 +22,100 @@ typedef enum {
     OP_NOT,
     OP_NEGATE,
     OP_RETURN,
+    // Superinstructions. Each one does the work of a common pair of instructions with a single dispatch.
+    OP_NOT_EQUAL,         // OP_EQUAL, OP_NOT
+    OP_GREATER_EQUAL,     // OP_LESS, OP_NOT
+    OP_LESS_EQUAL,        // OP_GREATER, OP_NOT
+    OP_ADD_CONSTANT,      // OP_CONSTANT, OP_ADD
+    OP_SUBTRACT_CONSTANT, // OP_CONSTANT, OP_SUBTRACT
+    OP_MULTIPLY_CONSTANT, // OP_CONSTANT, OP_MULTIPLY
+    OP_DIVIDE_CONSTANT,   // OP_CONSTANT, OP_DIVIDE
+    OP_CONCAT,            // A chain of OP_ADDs. The operand is how many values to add up, left to right.
+    // Quickened instructions. The compiler never emits these. run() rewrites a generic instruction into one of them after seeing what its operands
+    // are (see QUICKENING in common.h), and each one turns itself back into the generic instruction if its guess stops being true.
+    OP_ADD_NUM,               // OP_ADD that has seen two numbers
+    OP_ADD_STR,               // OP_ADD that has seen two strings
+    OP_EQUAL_NUM,             // OP_EQUAL that has seen two numbers
+    OP_NOT_EQUAL_NUM,         // OP_NOT_EQUAL that has seen two numbers
+    OP_ADD_CONSTANT_NUM,      // OP_*_CONSTANT whose constant is a number, and whose other operand was too
+    OP_SUBTRACT_CONSTANT_NUM,
+    OP_MULTIPLY_CONSTANT_NUM,
+    OP_DIVIDE_CONSTANT_NUM,
 } OpCode; // Operation Code
 
+// The register backend only runs if nothing is watching run()'s dispatch
+#if defined(REGISTER_VM) && !defined(DEBUG_PROFILE) && !defined(DEBUG_COUNT_OPCODE_PAIRS)
+#define REGISTER_VM_ENABLED
+#endif
+
+#ifdef REGISTER_VM_ENABLED
+/*
+  The register backend's instructions. Instead of pushing and popping, each one reads its operands and writes its result straight to a slot
+  of a window on the VM's stack. The window starts with the registers (register i is the stack slot at depth i), and right after them is a
+  copy of the constant pool. So an operand is just an index, whether it's a register or a constant, and "1 + 2 * 3" needs no loads at all.
+*/
+typedef enum {
+    ROP_LOADK,         // a = constants[b | c << 16]. Only for constants too far into the pool for an operand to reach.
+    ROP_NIL,           // a = nil
+    ROP_TRUE,          // a = true
+    ROP_FALSE,         // a = false
+    ROP_EQUAL,         // a = b == c
+    ROP_NOT_EQUAL,     // a = !(b == c)
+    ROP_GREATER,       // a = b > c
+    ROP_LESS,          // a = b < c
+    ROP_GREATER_EQUAL, // a = !(b < c), same as the stack code
+    ROP_LESS_EQUAL,    // a = !(b > c)
+    ROP_ADD,           // a = b + c
+    ROP_SUBTRACT,      // a = b - c
+    ROP_MULTIPLY,      // a = b * c
+    ROP_DIVIDE,        // a = b / c
+    ROP_NOT,           // a = !b
+    ROP_NEGATE,        // a = -b
+    ROP_CONCAT,        // a = a + a+1 + ... for b registers, like OP_CONCAT
+    ROP_RETURN,        // Prints b
+} RegisterOpCode;
+
+// Operands are 16 bits, so the constants after the first MAX_REGISTER_WINDOW - maxStack in the pool aren't in the window
+#define MAX_REGISTER_WINDOW (UINT16_MAX + 1)
+
+typedef struct {
+    uint16_t opcode;
+    uint16_t a; // The register the result goes in
+    uint16_t b; // The operands. Both are slots in the window (registers, or constants after them), unless the opcode says otherwise.
+    uint16_t c;
+} RegisterInstruction;
+#endif
+
+// A run of bytecode that all came from the same line. It starts at "offset" and lasts until the next run starts.
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
 typedef struct {
     int count;     // Number of bytes being currently used
     int capacity;  // Max array capacity
     uint8_t* code; // Byte array because it is BYTEcode. Took me too long to make that connection.
-    int* lines;
+    // Line numbers are run-length encoded. Consecutive instructions almost always share a line, so storing one int per byte would mostly repeat itself.
+    int lineCount;
+    int lineCapacity;
+    LineStart* lines;
     ValueArray constants; // Constant pool. The stack will store an index into this array for constants.
+    int maxStack; // The most values this chunk ever has on the stack at once. Worked out by the compiler, so the VM can size its stack up front.
+#ifdef REGISTER_VM_ENABLED
+    RegisterInstruction* registerCode; // The same program as register code. NULL if it couldn't be translated, and then the stack code runs.
+    int* registerOrigins; // Offset of the stack instruction each register instruction came from, so errors can find their line
+    int registerCount;
+#endif
 } Chunk; // Chunk of bytecode
 
 void initChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
-void freeChunk(Chunk* chunk);
-int addConstant(Chunk* chunk, Value value);
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
+void freeChunk(VM* vm, Chunk* chunk);
+int addConstant(VM* vm, Chunk* chunk, Value value);
+int getLine(Chunk* chunk, int offset);
+#ifdef REGISTER_VM_ENABLED
+void freeRegisterCode(VM* vm, Chunk* chunk);
+#endif
 
 #endif
\ No newline at end of file
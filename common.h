@@ -5,7 +5,42 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Packs every Value into a single 64-bit NaN-boxed double (see value.h). Comment this out to get the tagged union back.
+#define NAN_BOXING
+
+// Small allocations (objects, little arrays) come out of per-VM size-class free lists instead of malloc (see pool.c). Comment this out
+// (or build with -DNO_POOL_ALLOCATOR, like "make bench-pool" does) to go back to plain malloc, to compare the two, or when hunting memory
+// bugs with ASan, which can't see inside the pool.
+#ifndef NO_POOL_ALLOCATOR
+#define POOL_ALLOCATOR
+#endif
+
+// Let run() rewrite instructions in place into versions specialized for the types they've seen, like OP_ADD into OP_ADD_NUM (see vm.c).
+// Only pays off for programs that are run more than once, since the rewriting happens during a run. Comment this out to always run the generic instructions.
+#define QUICKENING
+
+// The benchmarks in bench/ build with -DNO_DEBUG_HOOKS, so they get a release build without anyone having to edit this file
+#ifndef NO_DEBUG_HOOKS
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#endif
+
+// #define DEBUG_COUNT_OPCODE_PAIRS // Count how often each opcode runs right after each other opcode, and print the most common pairs at freeVM(). Used to pick superinstructions.
+// #define DEBUG_PROFILE // Count and time every opcode and count how often each source line runs, and write the report to a JSON or CSV file at freeVM() (see profile.h)
+// #define DEBUG_STRESS_GC // Collect garbage on every allocation instead of waiting for nextGC. Great for flushing out objects that aren't rooted.
+// #define DEBUG_LOG_GC    // Log every mark, free and collection, and print the collector's counters at freeVM()
+
+// #define REGISTER_VM // Also translate every chunk into register code (see generateRegisterCode() in compiler.c) and run that instead of the stack code. The opcode profiler and pair counter only watch run(), so turning either of them on turns this off.
+
+// #define JIT // Compile programs that get run over and over into x86-64 machine code (see jit.c). Needs NAN_BOXING, x86-64 and mmap, and the debug hooks above turned off.
+
+// #define NO_CONSTANT_FOLDING // Compile every operator to its instruction, even when both operands are constants. The JIT test (tests/jit.c) uses it, since a program made of literals otherwise folds down to a single constant and leaves the JIT nothing to compile.
+
+// #define FIXED_HASH_SEED 0 // Seed the string hash with this instead of a fresh value every run (see hash.c). Makes hashes and table layouts reproducible, for tests and benchmarks.
+
+// GCC and Clang support labels-as-values, which run() uses for threaded dispatch. Everything else gets the plain switch.
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
 
 #endif
\ No newline at end of file
@@ -1,8 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -10,10 +12,13 @@
 #endif
 
 typedef struct {
+    Scanner scanner;
     Token current;
     Token previous;
     bool hadError;
     bool panicMode;
+    int operandStart; // Offset in the chunk where the left operand of the infix expression being compiled starts
+    int chainOffset; // Offset of the last OP_ADD, OP_ADD_CONSTANT or OP_CONCAT emitted for a +, so the next + can extend it into one OP_CONCAT. -1 if there isn't one.
 } Parser;
 
 // Since enums are just numbers, some enums are larger numerically than others. That is their precedence value.
@@ -31,8 +36,27 @@ typedef enum {
     PREC_PRIMARY
 } Precedence;
 
+typedef struct Compiler Compiler;
+
 // Parsing function pointer type
-typedef void (*ParseFn)();
+typedef void (*ParseFn)(Compiler* compiler);
+
+/*
+  Remembers which constants are already in the pool, so the same number or string literal is only stored once.
+  It's an open addressing hash table keyed on the constant's bits, not on valuesEqual(), because 0 and -0 are "equal" but aren't the same constant.
+  Entries are never removed. If folding pops a constant off the pool, its entry goes stale, and makeConstant() notices and adds it again.
+*/
+typedef struct {
+    Value value;
+    int index; // Where the value is in the pool, or -1 if the slot is empty
+    int uses;  // How many instructions in the chunk load it. Folding only pops a constant off the pool once nothing loads it anymore.
+} ConstantSlot;
+
+typedef struct {
+    int count;
+    int capacity;
+    ConstantSlot* slots;
+} ConstantCache;
 
 typedef struct {
     ParseFn prefix;        // The function to compile the prefix expression this token is used for
@@ -40,17 +64,50 @@ typedef struct {
     Precedence precedence; // The precedence of the infix expression when using this token as an operator
 } ParseRule; // Represents a row in the parser table (see line 178)
 
-Parser parser;
-Chunk* compilingChunk;
+// Everything one call to compile() is working with. It lives on compile()'s stack, so any number of threads can compile at once.
+struct Compiler {
+    VM* vm; // Where the strings and the chunk get allocated
+    Parser* parser;
+    Chunk* chunk; // The chunk being compiled into
+    int stackDepth; // How many values the code emitted so far leaves on the VM's stack
+    ConstantCache constantCache;
+};
+
+// How many values each instruction leaves on the stack, minus how many it takes off
+static const int stackEffects[] = {
+    [OP_CONSTANT]          = 1,
+    [OP_CONSTANT_LONG]     = 1,
+    [OP_NIL]               = 1,
+    [OP_TRUE]              = 1,
+    [OP_FALSE]             = 1,
+    [OP_EQUAL]             = -1,
+    [OP_GREATER]           = -1,
+    [OP_LESS]              = -1,
+    [OP_ADD]               = -1,
+    [OP_SUBTRACT]          = -1,
+    [OP_MULTIPLY]          = -1,
+    [OP_DIVIDE]            = -1,
+    [OP_NOT]               = 0,
+    [OP_NEGATE]            = 0,
+    [OP_RETURN]            = -1,
+    [OP_NOT_EQUAL]         = -1,
+    [OP_GREATER_EQUAL]     = -1,
+    [OP_LESS_EQUAL]        = -1,
+    [OP_ADD_CONSTANT]      = 0,
+    [OP_SUBTRACT_CONSTANT] = 0,
+    [OP_MULTIPLY_CONSTANT] = 0,
+    [OP_DIVIDE_CONSTANT]   = 0,
+    [OP_CONCAT]            = 0, // Depends on its operand, so binary() accounts for it itself
+};
 
 // For user-defined function, the "current chunk" becomes a bit more nuanced. So, this will hold that logic.
-static Chunk* currentChunk() {
-    return compilingChunk;
+static Chunk* currentChunk(Compiler* compiler) {
+    return compiler->chunk;
 }
 
-static void errorAt(Token* token, const char* message) {
-    if (parser.panicMode) return; // If in panic mode, ignore errors until recovery point (will be added later)
-    parser.panicMode = true;
+static void errorAt(Parser* parser, Token* token, const char* message) {
+    if (parser->panicMode) return; // If in panic mode, ignore errors until recovery point (will be added later)
+    parser->panicMode = true;
     // Print to error stream the line of the error 
     fprintf(stderr, "[line %d] Error", token->line); // I lowkey love C syntax
 
@@ -66,150 +123,516 @@ static void errorAt(Token* token, const char* message) {
 
     // Print error message
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    parser->hadError = true;
 }
 
 // Reports an error at the token that was just consumed
-static void error(const char* message) {
-    errorAt(&parser.previous, message);
+static void error(Parser* parser, const char* message) {
+    errorAt(parser, &parser->previous, message);
 }
 
 // Reports an error at the current token
-static void errorAtCurrent(const char* message) {
-    errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+    errorAt(parser, &parser->current, message);
 }
 
 // "Advance" a token in parsing/compilation. Basically, move the current token back one, then move forward a token
-static void advance() {
-    parser.previous = parser.current; // Store the current token
+static void advance(Parser* parser) {
+    parser->previous = parser->current; // Store the current token
 
     // Error check loop. Continues only if there is an error, so the parser only sees valid tokens
     for (;;) {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR) break; 
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR) break; 
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
 // Like advance, but checks for the expected type. Main source of syntax errors.
-static void consume(TokenType type, const char* message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return; // No need to fall through to error if its right
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
 // Add a byte (opcode or operand) to the chunk. The previous token's line info is sent so that runtime errors are associated with that line.
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Compiler* compiler, uint8_t byte) {
+    writeChunk(compiler->vm, currentChunk(compiler), byte, compiler->parser->previous.line);
+}
+
+// Keeps track of how deep the stack gets, so the VM can make room for all of it before running the chunk
+static void adjustStack(Compiler* compiler, int effect) {
+    compiler->stackDepth += effect;
+    if (compiler->stackDepth > currentChunk(compiler)->maxStack) currentChunk(compiler)->maxStack = compiler->stackDepth;
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+// Emits an opcode (its operands are emitted separately with emitByte()) and accounts for what it does to the stack
+static void emitOp(Compiler* compiler, uint8_t opcode) {
+    emitByte(compiler, opcode);
+    adjustStack(compiler, stackEffects[opcode]);
 }
 
 // When clox is run, it parses, compiles, and executes an expression, then prints it result. So, we temporarily use return to do that.
-static void emitReturn() {
-    emitByte(OP_RETURN);
+static void emitReturn(Compiler* compiler) {
+    emitOp(compiler, OP_RETURN);
+}
+
+// The bits that identify a constant. Only numbers and strings end up in the pool, and strings are interned, so their pointer is enough.
+static uint64_t constantBits(Value value) {
+#ifdef NAN_BOXING
+    return value;
+#else
+    if (IS_OBJ(value)) return (uint64_t)(uintptr_t)AS_OBJ(value);
+    uint64_t bits;
+    memcpy(&bits, &AS_NUMBER(value), sizeof(uint64_t));
+    return bits;
+#endif
+}
+
+static bool sameConstant(Value a, Value b) {
+    return IS_OBJ(a) == IS_OBJ(b) && constantBits(a) == constantBits(b);
 }
 
-// Adds a value to the end of current chunk's constant table/pool, and then returns its index
-static uint8_t makeConstant(Value value) {
-    int constantIndex = addConstant(currentChunk(), value);
-    if (constantIndex > UINT8_MAX) {
-        error("Too many constants in one chunk."); // Chunk of BYTEcode
+// Finds the slot for "value", or the empty slot where it would go
+static ConstantSlot* findConstantSlot(Compiler* compiler, Value value) {
+    // Multiplying by a big odd number spreads the bits out, so numbers like 1, 2, 3 (which only differ in their high bits) don't all collide
+    uint64_t hash = constantBits(value) * 0x9E3779B97F4A7C15;
+    uint32_t mask = (uint32_t)compiler->constantCache.capacity - 1;
+    uint32_t index = (uint32_t)(hash >> 32) & mask;
+
+    for (;;) {
+        ConstantSlot* slot = &compiler->constantCache.slots[index];
+        if (slot->index == -1 || sameConstant(slot->value, value)) return slot;
+        index = (index + 1) & mask; // Linear probing
+    }
+}
+
+static void growConstantCache(Compiler* compiler) {
+    ConstantSlot* oldSlots = compiler->constantCache.slots;
+    int oldCapacity = compiler->constantCache.capacity;
+
+    compiler->constantCache.capacity = GROW_CAPACITY(oldCapacity);
+    compiler->constantCache.slots = ALLOCATE(compiler->vm, MEM_COMPILER, ConstantSlot, compiler->constantCache.capacity);
+    for (int i = 0; i < compiler->constantCache.capacity; i++) compiler->constantCache.slots[i].index = -1;
+
+    for (int i = 0; i < oldCapacity; i++) {
+        if (oldSlots[i].index == -1) continue;
+        *findConstantSlot(compiler, oldSlots[i].value) = oldSlots[i];
+    }
+    FREE_ARRAY(compiler->vm, MEM_COMPILER, ConstantSlot, oldSlots, oldCapacity);
+}
+
+static void freeConstantCache(Compiler* compiler) {
+    FREE_ARRAY(compiler->vm, MEM_COMPILER, ConstantSlot, compiler->constantCache.slots, compiler->constantCache.capacity);
+    compiler->constantCache.count = 0;
+    compiler->constantCache.capacity = 0;
+    compiler->constantCache.slots = NULL;
+}
+
+// Returns the index of a value in the current chunk's constant pool, adding it to the pool if it isn't there yet
+static int makeConstant(Compiler* compiler, Value value) {
+    Chunk* chunk = currentChunk(compiler);
+
+    // Kept at most half full, so probe sequences stay short. Growing it can trigger a collection, and a new string isn't reachable from anywhere yet.
+    if (compiler->constantCache.count + 1 > compiler->constantCache.capacity / 2) {
+        push(compiler->vm, value);
+        growConstantCache(compiler);
+        pop(compiler->vm);
+    }
+
+    ConstantSlot* slot = findConstantSlot(compiler, value);
+    bool isStale = slot->index != -1 &&
+        (slot->index >= chunk->constants.count || !sameConstant(chunk->constants.values[slot->index], value));
+
+    if (slot->index == -1 || isStale) {
+        if (slot->index == -1) compiler->constantCache.count++;
+        slot->value = value;
+        slot->index = addConstant(compiler->vm, chunk, value);
+        slot->uses = 0;
+    }
+
+    if (slot->index > MAX_CONSTANTS - 1) {
+        error(compiler->parser, "Too many constants in one chunk."); // Chunk of BYTEcode
         return 0;
     }
 
-    return (uint8_t)constantIndex;
+    slot->uses++;
+    return slot->index;
+}
+
+// Emits the instruction that loads a constant. The first 256 constants get the short form, and the rest need a 24-bit operand.
+static void emitConstant(Compiler* compiler, Value value) {
+    int constant = makeConstant(compiler, value);
+    if (constant <= UINT8_MAX) {
+        emitOp(compiler, OP_CONSTANT);
+        emitByte(compiler, (uint8_t)constant);
+    } else {
+        // Little endian, lowest byte first
+        emitOp(compiler, OP_CONSTANT_LONG);
+        emitByte(compiler, (uint8_t)(constant & 0xFF));
+        emitByte(compiler, (uint8_t)((constant >> 8) & 0xFF));
+        emitByte(compiler, (uint8_t)((constant >> 16) & 0xFF));
+    }
+}
+
+// Emits whichever instruction loads a value the cheapest. nil, true and false have their own opcodes, so they don't need a constant.
+static void emitValue(Compiler* compiler, Value value) {
+    if (IS_NIL(value)) {
+        emitOp(compiler, OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitOp(compiler, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(compiler, value);
+    }
+}
+
+/*
+  Constant folding helpers. An operand is constant if all the code compiled for it is a single instruction that loads a constant.
+  Operators always emit their opcode after their operands, so a constant load can't be the tail end of some bigger expression.
+*/
+
+// The pool index loaded by the OP_CONSTANT or OP_CONSTANT_LONG at "offset", or -1 if it's some other instruction
+static int constantIndexAt(Compiler* compiler, int offset) {
+    uint8_t* code = currentChunk(compiler)->code;
+    switch (code[offset]) {
+        case OP_CONSTANT:      return code[offset + 1];
+        case OP_CONSTANT_LONG: return code[offset + 1] | (code[offset + 2] << 8) | (code[offset + 3] << 16);
+        default:               return -1;
+    }
+}
+
+// If the instruction at "offset" loads a constant, stores it in "value" and returns the instruction's length. Otherwise returns 0.
+static int readConstant(Compiler* compiler, int offset, Value* value) {
+    Chunk* chunk = currentChunk(compiler);
+    if (offset >= chunk->count) return 0;
+
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:      *value = chunk->constants.values[constantIndexAt(compiler, offset)]; return 2;
+        case OP_CONSTANT_LONG: *value = chunk->constants.values[constantIndexAt(compiler, offset)]; return 4;
+        case OP_NIL:           *value = NIL_VAL; return 1;
+        case OP_TRUE:          *value = BOOL_VAL(true); return 1;
+        case OP_FALSE:         *value = BOOL_VAL(false); return 1;
+        default:               return 0;
+    }
+}
+
+// Checks if the code from "start" to "end" is exactly one constant load
+static bool isConstantOperand(Compiler* compiler, int start, int end, Value* value) {
+#ifdef NO_CONSTANT_FOLDING
+    // Nothing counts as a constant, so nothing gets folded
+    (void)compiler;
+    (void)start;
+    (void)end;
+    (void)value;
+    return false;
+#else
+    return readConstant(compiler, start, value) == end - start;
+#endif
 }
 
-// Adds a constant to the constant table, pushes its index in the constant table onto the stack, then pushes a constant opcode onto the stack
-static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+// Pops the constants used by the constant loads from "offset" onwards off the pool, as long as they're at the end of it and nothing else loads them. The last load's constant is popped first.
+static void popConstants(Compiler* compiler, int offset) {
+    Chunk* chunk = currentChunk(compiler);
+    Value value;
+    int length = readConstant(compiler, offset, &value);
+    if (length == 0) return;
+
+    popConstants(compiler, offset + length);
+    int index = constantIndexAt(compiler, offset);
+    if (index == -1) return;
+
+    ConstantSlot* slot = findConstantSlot(compiler, value);
+    if (slot->index != index) return; // Every constant goes through makeConstant(), so this shouldn't happen
+    slot->uses--;
+    if (slot->uses == 0 && index == chunk->constants.count - 1) {
+        chunk->constants.count--;
+    }
+}
+
+// Throws away the constant loads from "start" onwards, along with the constants that were only added for them
+static void discardCode(Compiler* compiler, int start) {
+    Chunk* chunk = currentChunk(compiler);
+    popConstants(compiler, start);
+
+    // Each of the loads pushed one value. maxStack isn't lowered, so it can come out a little bigger than it needs to be, which is harmless.
+    Value value;
+    for (int offset = start; offset < chunk->count;) {
+        int length = readConstant(compiler, offset, &value);
+        if (length == 0) break;
+        offset += length;
+        compiler->stackDepth--;
+    }
+    chunk->count = start;
+    if (compiler->parser->chainOffset >= start) compiler->parser->chainOffset = -1;
+}
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Computes a binary operation on two constants at compile time, doing exactly what the VM would. Returns false if it would be a runtime error, so the error still happens at runtime.
+static bool foldBinary(Compiler* compiler, TokenType operatorType, Value a, Value b, Value* result) {
+    if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+        // Ropes need flattening before they can be compared. Both operands are in the constant pool, so they're safe from the GC.
+        a = flattenValue(compiler->vm, a);
+        b = flattenValue(compiler->vm, b);
+    }
+    if (operatorType == TOKEN_EQUAL_EQUAL) {
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    }
+    if (operatorType == TOKEN_BANG_EQUAL) {
+        *result = BOOL_VAL(!valuesEqual(a, b));
+        return true;
+    }
+
+    if (operatorType == TOKEN_PLUS && IS_ANY_STRING(a) && IS_ANY_STRING(b)) {
+        // Both strings are still in the constant pool, so they survive if this triggers a collection. Long results are ropes until endCompiler() flattens them.
+        *result = OBJ_VAL(concatenateStrings(compiler->vm, AS_OBJ(a), AS_OBJ(b)));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+
+    switch (operatorType) {
+        case TOKEN_PLUS:          *result = NUMBER_VAL(x + y); return true;
+        case TOKEN_MINUS:         *result = NUMBER_VAL(x - y); return true;
+        case TOKEN_STAR:          *result = NUMBER_VAL(x * y); return true;
+        case TOKEN_SLASH:         *result = NUMBER_VAL(x / y); return true;
+        case TOKEN_GREATER:       *result = BOOL_VAL(x > y); return true;
+        case TOKEN_LESS:          *result = BOOL_VAL(x < y); return true;
+        // These two are compiled as the negation of the opposite comparison, which gives a different answer for NaN, so we fold them the same way.
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+        case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y)); return true;
+        default:                  return false;
+    }
 }
 
-static void endCompiler() {
-    emitReturn();
+static void endCompiler(Compiler* compiler) {
+    emitReturn(compiler);
+
+    // Folding can leave ropes in the constant pool. They're flattened here, so the VM, the disassembler and images only ever see plain strings there.
+    ValueArray* constants = &currentChunk(compiler)->constants;
+    for (int i = 0; i < constants->count; i++) {
+        constants->values[i] = flattenValue(compiler->vm, constants->values[i]);
+    }
+
+#ifdef REGISTER_VM_ENABLED
+    if (!compiler->parser->hadError) generateRegisterCode(compiler->vm, currentChunk(compiler));
+#endif
+
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {  // Only dump chunk if there was no errors
-        disassembleChunk(currentChunk(), "code");
+    if (!compiler->parser->hadError) {  // Only dump chunk if there was no errors
+        disassembleChunk(currentChunk(compiler), "code");
+#ifdef REGISTER_VM_ENABLED
+        if (currentChunk(compiler)->registerCode != NULL) disassembleRegisterCode(currentChunk(compiler), "registers");
+#endif
     }
 #endif
 }
 
 // Forward declarations for use in grammar production methods
-static void expression();
+static void expression(Compiler* compiler);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Compiler* compiler, Precedence precedence);
+
+// The superinstruction for an arithmetic operator whose right operand is a constant, or -1 if there isn't one
+static int constantOperandOp(TokenType operatorType) {
+    switch (operatorType) {
+        case TOKEN_PLUS:  return OP_ADD_CONSTANT;
+        case TOKEN_MINUS: return OP_SUBTRACT_CONSTANT;
+        case TOKEN_STAR:  return OP_MULTIPLY_CONSTANT;
+        case TOKEN_SLASH: return OP_DIVIDE_CONSTANT;
+        default:          return -1;
+    }
+}
+
+/*
+  a + b + c compiles to one OP_CONCAT 3 instead of two OP_ADDs, so concatenating strings doesn't build (and intern) every string in between.
+  If the left operand of a + ended with the instruction for another + (OP_ADD, OP_ADD_CONSTANT with a string, or OP_CONCAT), that instruction is
+  taken back out and the whole chain ends with one OP_CONCAT instead. Returns false if the chain can't be extended.
+  Only a constant right operand can join the chain. Anything else could fail at runtime, and moving it in front of the + before it would
+  change which error gets reported.
+*/
+static bool extendChain(Compiler* compiler, int rightStart) {
+    Parser* parser = compiler->parser;
+    Chunk* chunk = currentChunk(compiler);
+    int offset = parser->chainOffset;
+    Value constant;
+    int rightLength = readConstant(compiler, rightStart, &constant);
+    if (offset == -1 || rightLength == 0 || rightStart + rightLength != chunk->count) return false;
+
+    int operands;
+    int length;
+    switch (chunk->code[offset]) {
+        case OP_ADD:
+            operands = 2;
+            length = 1;
+            break;
+        case OP_ADD_CONSTANT:
+            // A number there is most likely arithmetic, which the superinstruction does better than OP_CONCAT's fallback
+            if (!IS_STRING(chunk->constants.values[chunk->code[offset + 1]])) return false;
+            operands = 2;
+            length = 2;
+            break;
+        case OP_CONCAT:
+            operands = chunk->code[offset + 1];
+            if (operands == UINT8_MAX) return false;
+            length = 2;
+            break;
+        default:
+            return false;
+    }
+    if (offset + length != rightStart) return false; // It has to be the left operand's last instruction
+
+    uint8_t right[4];
+    memcpy(right, &chunk->code[rightStart], rightLength);
+    compiler->stackDepth--; // The right operand comes off for now
+
+    if (chunk->code[offset] == OP_ADD_CONSTANT) {
+        // Same operand, so it just turns back into a load
+        chunk->code[offset] = OP_CONSTANT;
+        chunk->count = rightStart;
+        compiler->stackDepth++;
+    } else {
+        chunk->count = offset;
+        compiler->stackDepth += operands - 1;
+    }
+
+    // Put the right operand back after all the other operands, then add them all up in one go
+    emitOp(compiler, right[0]);
+    for (int i = 1; i < rightLength; i++) emitByte(compiler, right[i]);
+    parser->chainOffset = chunk->count;
+    emitOp(compiler, OP_CONCAT);
+    emitByte(compiler, (uint8_t)(operands + 1));
+    adjustStack(compiler, -operands); // Takes all the operands off and pushes the result
+    return true;
+}
 
 // Compiles the right operand, then emits the operation opcode
-static void binary() {
+static void binary(Compiler* compiler) {
+    Parser* parser = compiler->parser;
     // Handles operation precedence, so we can use 1 function for all binary operations
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
+    int leftStart = parser->operandStart;
+    int rightStart = currentChunk(compiler)->count;
     ParseRule* rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1)); // +1 because binary operations associate left
+    parsePrecedence(compiler, (Precedence)(rule->precedence + 1)); // +1 because binary operations associate left
+
+    // If both operands are constants, do the operation now and replace all of it with the result
+    Value a, b, result;
+    if (!parser->hadError &&
+        isConstantOperand(compiler, leftStart, rightStart, &a) &&
+        isConstantOperand(compiler, rightStart, currentChunk(compiler)->count, &b) &&
+        foldBinary(compiler, operatorType, a, b, &result)) {
+        discardCode(compiler, leftStart);
+        emitValue(compiler, result);
+        return;
+    }
+
+    if (operatorType == TOKEN_PLUS && !parser->hadError && extendChain(compiler, rightStart)) return;
+
+    // If the right operand is a constant from the pool, fuse its load into the arithmetic instruction
+    Chunk* chunk = currentChunk(compiler);
+    int fused = constantOperandOp(operatorType);
+    if (fused != -1 && chunk->count == rightStart + 2 && chunk->code[rightStart] == OP_CONSTANT) {
+        uint8_t constant = chunk->code[rightStart + 1];
+        // Drop the OP_CONSTANT, but keep the constant. maxStack still counts the slot it used, which OP_ADD_CONSTANT needs anyway when it concatenates strings.
+        chunk->count = rightStart;
+        compiler->stackDepth--;
+        if (parser->chainOffset >= rightStart) parser->chainOffset = -1;
+        if (operatorType == TOKEN_PLUS) parser->chainOffset = chunk->count;
+        emitOp(compiler, (uint8_t)fused);
+        emitByte(compiler, constant);
+        return;
+    }
 
     switch (operatorType) {
-        case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:          emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:          emitByte(OP_ADD); break;
-        case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
+        case TOKEN_BANG_EQUAL:    emitOp(compiler, OP_NOT_EQUAL); break;
+        case TOKEN_EQUAL_EQUAL:   emitOp(compiler, OP_EQUAL); break;
+        case TOKEN_GREATER:       emitOp(compiler, OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL: emitOp(compiler, OP_GREATER_EQUAL); break;
+        case TOKEN_LESS:          emitOp(compiler, OP_LESS); break;
+        case TOKEN_LESS_EQUAL:    emitOp(compiler, OP_LESS_EQUAL); break;
+        case TOKEN_PLUS:
+            parser->chainOffset = currentChunk(compiler)->count;
+            emitOp(compiler, OP_ADD);
+            break;
+        case TOKEN_MINUS:         emitOp(compiler, OP_SUBTRACT); break;
+        case TOKEN_STAR:          emitOp(compiler, OP_MULTIPLY); break;
+        case TOKEN_SLASH:         emitOp(compiler, OP_DIVIDE); break;
     }
 }
 
-static void literal() {
+static void literal(Compiler* compiler) {
+    Parser* parser = compiler->parser;
     // Keyword token has already been consumed
-    switch (parser.previous.type) {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
+    switch (parser->previous.type) {
+        case TOKEN_FALSE: emitOp(compiler, OP_FALSE); break;
+        case TOKEN_NIL: emitOp(compiler, OP_NIL); break;
+        case TOKEN_TRUE: emitOp(compiler, OP_TRUE); break;
         default: return; // Unreachable
     }
 }
 
-static void grouping() {
-    expression();
+static void grouping(Compiler* compiler) {
+    Parser* parser = compiler->parser;
+    expression(compiler);
     // Assumes the token has already been consumed
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 
     // Doesn't emit any bytecode because a grouping expression just changes precedence.
 }
 
 // Wraps a number into a Value
-static void number() {
+static void number(Compiler* compiler) {
+    Parser* parser = compiler->parser;
     // Assume the token has already been consumed (use the previous token)
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    double value = strtod(parser->previous.start, NULL);
+    emitConstant(compiler, NUMBER_VAL(value));
 }
 
 // Creates a String Obj, then wraps it in a Value
-static void string() {
+static void string(Compiler* compiler) {
+    Parser* parser = compiler->parser;
     // +1 and -2 trim quotation marks
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    emitConstant(compiler, OBJ_VAL(copyString(compiler->vm, parser->previous.start + 1, parser->previous.length - 2)));
 }
 
-static void unary() {
+static void unary(Compiler* compiler) {
+    Parser* parser = compiler->parser;
     // Assume the token has already been consumed (use the previous token)
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
 
     // Compile/evaluate the operand. This is done first so negation is done correctly
-    parsePrecedence(PREC_UNARY);
+    int operandStart = currentChunk(compiler)->count;
+    parsePrecedence(compiler, PREC_UNARY);
+
+    // Fold the operator into the operand if it's a constant. Negating a non-number is left for the VM to report.
+    Value operand;
+    if (!parser->hadError && isConstantOperand(compiler, operandStart, currentChunk(compiler)->count, &operand)) {
+        if (operatorType == TOKEN_BANG) {
+            discardCode(compiler, operandStart);
+            emitValue(compiler, BOOL_VAL(isFalsey(operand)));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+            discardCode(compiler, operandStart);
+            emitValue(compiler, NUMBER_VAL(-AS_NUMBER(operand)));
+            return;
+        }
+    }
 
     // Emit the operator instruction. 
     switch (operatorType) {
-        case TOKEN_BANG: emitByte(OP_NOT); break;
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_BANG: emitOp(compiler, OP_NOT); break;
+        case TOKEN_MINUS: emitOp(compiler, OP_NEGATE); break;
         default: return; // Unreachable
     }
 }
@@ -230,7 +653,7 @@ ParseRule rules[] = {
     [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR},
     [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR},
     [TOKEN_BANG]          = {unary,    NULL,   PREC_NONE},
-    [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_NONE},
+    [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_EQUALITY},
     [TOKEN_EQUAL]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_EQUAL_EQUAL]   = {NULL,     binary, PREC_EQUALITY},
     [TOKEN_GREATER]       = {NULL,     binary, PREC_COMPARISON},
@@ -260,23 +683,26 @@ ParseRule rules[] = {
     [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
 
-static void parsePrecedence(Precedence precedence) {
-    advance();
+static void parsePrecedence(Compiler* compiler, Precedence precedence) {
+    Parser* parser = compiler->parser;
+    advance(parser);
 
     // Parse prefix expression (the current token is ALWAYS a prefix expression)
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    int start = currentChunk(compiler)->count;
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == NULL) {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
-    prefixRule();
+    prefixRule(compiler);
 
     // Parse infix expressions (if precedence parameter permits)
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule();
+    while (precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        parser->operandStart = start; // Everything compiled since "start" is the infix expression's left operand
+        infixRule(compiler);
     }
 }
 
@@ -285,22 +711,224 @@ static ParseRule* getRule(TokenType type) {
     return &rules[type];
 }
 
-static void expression() {
-    parsePrecedence(PREC_ASSIGNMENT);
+static void expression(Compiler* compiler) {
+    parsePrecedence(compiler, PREC_ASSIGNMENT);
 }
 
-bool compile(const char* source, Chunk* chunk) {
+bool compile(VM* vm, const char* source, Chunk* chunk) {
     // Initilization
-    initScanner(source);
-    compilingChunk = chunk;
-
-
+    Parser parser;
+    initScanner(&parser.scanner, source);
     parser.hadError = false;
     parser.panicMode = false;
-
-    advance();
-    expression(); 
-    consume(TOKEN_EOF, "Expect end of expression"); // Expect end of file
-    endCompiler(); // Adds OP_RETURN to the end of the chunk
+    parser.chainOffset = -1;
+
+    Compiler compiler;
+    compiler.vm = vm;
+    compiler.parser = &parser;
+    compiler.chunk = chunk;
+    compiler.stackDepth = 0;
+    compiler.constantCache.count = 0;
+    compiler.constantCache.capacity = 0;
+    compiler.constantCache.slots = NULL;
+    vm->compiler = &compiler;
+
+    advance(&parser);
+    expression(&compiler); 
+    consume(&parser, TOKEN_EOF, "Expect end of expression"); // Expect end of file
+    endCompiler(&compiler); // Adds OP_RETURN to the end of the chunk
+    freeConstantCache(&compiler);
+    vm->compiler = NULL;
     return !parser.hadError; // Returns whether or not compilation suceeded (false if theres an error)
-}
\ No newline at end of file
+}
+
+// Constants in the chunk being compiled aren't reachable from the VM yet, so the GC asks the compiler for them
+void markCompilerRoots(VM* vm) {
+    if (vm->compiler == NULL) return;
+
+    Chunk* chunk = vm->compiler->chunk;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        markValue(vm, chunk->constants.values[i]);
+    }
+}
+
+#ifdef REGISTER_VM_ENABLED
+/*
+  The register backend's code generator. It runs over the finished stack code, after folding and the superinstructions have had their go,
+  and writes the same program out as register code (see RegisterOpCode in chunk.h).
+  There's no control flow, so the stack depth at every instruction is known ahead of time, and the value at depth i just lives in register i.
+  Pushing a constant doesn't emit anything. The slot remembers the constant's place in the window instead, and whatever uses the slot
+  reads the constant from there. That's where most of the savings are, since about half of a typical chunk is instructions pushing constants.
+*/
+typedef struct {
+    VM* vm;
+    Chunk* chunk;
+    int capacity;
+    uint16_t* slots; // Where each stack slot's value is in the window: the slot's own register, or a constant that hasn't been loaded into it
+} RegisterGenerator;
+
+static void emitRegister(RegisterGenerator* generator, RegisterOpCode opcode, int a, int b, int c, int origin) {
+    Chunk* chunk = generator->chunk;
+    if (generator->capacity < chunk->registerCount + 1) {
+        int oldCapacity = generator->capacity;
+        generator->capacity = GROW_CAPACITY(oldCapacity);
+        chunk->registerCode = GROW_ARRAY(generator->vm, MEM_CODE, RegisterInstruction, chunk->registerCode, oldCapacity, generator->capacity);
+        chunk->registerOrigins = GROW_ARRAY(generator->vm, MEM_CODE, int, chunk->registerOrigins, oldCapacity, generator->capacity);
+    }
+
+    RegisterInstruction* instruction = &chunk->registerCode[chunk->registerCount];
+    instruction->opcode = (uint16_t)opcode;
+    instruction->a = (uint16_t)a;
+    instruction->b = (uint16_t)b;
+    instruction->c = (uint16_t)c;
+    chunk->registerOrigins[chunk->registerCount] = origin;
+    chunk->registerCount++;
+}
+
+static bool isWindowConstant(RegisterGenerator* generator, uint16_t operand) {
+    return operand >= generator->chunk->maxStack;
+}
+
+// Constants in the window are read from there. The rare one past the end of it gets loaded into the slot's register.
+static void pushConstant(RegisterGenerator* generator, int slot, int index, int origin) {
+    int operand = generator->chunk->maxStack + index;
+    if (operand < MAX_REGISTER_WINDOW) {
+        generator->slots[slot] = (uint16_t)operand;
+        return;
+    }
+    emitRegister(generator, ROP_LOADK, slot, index & 0xFFFF, index >> 16, origin);
+    generator->slots[slot] = (uint16_t)slot;
+}
+
+// For instructions that need the value in its register, not just somewhere they can read it from
+static void materialize(RegisterGenerator* generator, int slot, int origin) {
+    uint16_t operand = generator->slots[slot];
+    if (!isWindowConstant(generator, operand)) return;
+    emitRegister(generator, ROP_LOADK, slot, operand - generator->chunk->maxStack, 0, origin);
+    generator->slots[slot] = (uint16_t)slot;
+}
+
+static void emitLiteral(RegisterGenerator* generator, RegisterOpCode opcode, int slot, int origin) {
+    emitRegister(generator, opcode, slot, 0, 0, origin);
+    generator->slots[slot] = (uint16_t)slot;
+}
+
+// The operands are the slot "left" and the one above it. The result replaces the left one, like it does on the stack.
+static void emitBinary(RegisterGenerator* generator, RegisterOpCode opcode, int left, int origin) {
+    emitRegister(generator, opcode, left, generator->slots[left], generator->slots[left + 1], origin);
+    generator->slots[left] = (uint16_t)left;
+}
+
+static void emitUnary(RegisterGenerator* generator, RegisterOpCode opcode, int slot, int origin) {
+    emitRegister(generator, opcode, slot, generator->slots[slot], 0, origin);
+    generator->slots[slot] = (uint16_t)slot;
+}
+
+static bool translateChunk(RegisterGenerator* generator) {
+    Chunk* chunk = generator->chunk;
+    int depth = 0; // How many values are on the stack before the current instruction
+    int offset = 0;
+    while (offset < chunk->count) {
+        uint8_t* code = &chunk->code[offset];
+        int top = depth - 1;
+        // Quickened instructions only turn up in an image written from a program that already ran. They mean the same as their generic ones.
+        switch (code[0]) {
+            case OP_CONSTANT:      pushConstant(generator, depth++, code[1], offset); offset += 2; break;
+            case OP_CONSTANT_LONG: pushConstant(generator, depth++, code[1] | (code[2] << 8) | (code[3] << 16), offset); offset += 4; break;
+            case OP_NIL:   emitLiteral(generator, ROP_NIL, depth++, offset); offset++; break;
+            case OP_TRUE:  emitLiteral(generator, ROP_TRUE, depth++, offset); offset++; break;
+            case OP_FALSE: emitLiteral(generator, ROP_FALSE, depth++, offset); offset++; break;
+            case OP_EQUAL:
+            case OP_EQUAL_NUM:     emitBinary(generator, ROP_EQUAL, top - 1, offset); depth--; offset++; break;
+            case OP_NOT_EQUAL:
+            case OP_NOT_EQUAL_NUM: emitBinary(generator, ROP_NOT_EQUAL, top - 1, offset); depth--; offset++; break;
+            case OP_GREATER:       emitBinary(generator, ROP_GREATER, top - 1, offset); depth--; offset++; break;
+            case OP_LESS:          emitBinary(generator, ROP_LESS, top - 1, offset); depth--; offset++; break;
+            case OP_GREATER_EQUAL: emitBinary(generator, ROP_GREATER_EQUAL, top - 1, offset); depth--; offset++; break;
+            case OP_LESS_EQUAL:    emitBinary(generator, ROP_LESS_EQUAL, top - 1, offset); depth--; offset++; break;
+            case OP_ADD:
+            case OP_ADD_NUM:
+            case OP_ADD_STR:  emitBinary(generator, ROP_ADD, top - 1, offset); depth--; offset++; break;
+            case OP_SUBTRACT: emitBinary(generator, ROP_SUBTRACT, top - 1, offset); depth--; offset++; break;
+            case OP_MULTIPLY: emitBinary(generator, ROP_MULTIPLY, top - 1, offset); depth--; offset++; break;
+            case OP_DIVIDE:   emitBinary(generator, ROP_DIVIDE, top - 1, offset); depth--; offset++; break;
+            // The superinstructions' constant goes in the slot above, where OP_CONSTANT would have put it. Its index is one byte, so it never needs loading.
+            case OP_ADD_CONSTANT:
+            case OP_ADD_CONSTANT_NUM:
+                pushConstant(generator, depth, code[1], offset);
+                emitBinary(generator, ROP_ADD, top, offset);
+                offset += 2;
+                break;
+            case OP_SUBTRACT_CONSTANT:
+            case OP_SUBTRACT_CONSTANT_NUM:
+                pushConstant(generator, depth, code[1], offset);
+                emitBinary(generator, ROP_SUBTRACT, top, offset);
+                offset += 2;
+                break;
+            case OP_MULTIPLY_CONSTANT:
+            case OP_MULTIPLY_CONSTANT_NUM:
+                pushConstant(generator, depth, code[1], offset);
+                emitBinary(generator, ROP_MULTIPLY, top, offset);
+                offset += 2;
+                break;
+            case OP_DIVIDE_CONSTANT:
+            case OP_DIVIDE_CONSTANT_NUM:
+                pushConstant(generator, depth, code[1], offset);
+                emitBinary(generator, ROP_DIVIDE, top, offset);
+                offset += 2;
+                break;
+            case OP_NOT:    emitUnary(generator, ROP_NOT, top, offset); offset++; break;
+            case OP_NEGATE: emitUnary(generator, ROP_NEGATE, top, offset); offset++; break;
+            case OP_CONCAT: {
+                // The operands get added up where they are, so they all have to be in their registers
+                int count = code[1];
+                int first = depth - count;
+                for (int slot = first; slot < depth; slot++) materialize(generator, slot, offset);
+                emitRegister(generator, ROP_CONCAT, first, count, 0, offset);
+                depth = first + 1;
+                offset += 2;
+                break;
+            }
+            case OP_RETURN:
+                emitRegister(generator, ROP_RETURN, 0, generator->slots[top], 0, offset);
+                return true;
+            default:
+                return false;
+        }
+
+        // The registers are the stack's slots, so a chunk whose maxStack is wrong (a damaged image, say) would write past the stack
+        if (depth > chunk->maxStack) return false;
+    }
+
+    return false; // Every chunk ends with OP_RETURN
+}
+
+// Translates the chunk's stack code into register code. The stack code stays, since images are written from it.
+bool generateRegisterCode(VM* vm, Chunk* chunk) {
+    // Every register has to fit in an operand
+    if (chunk->maxStack >= MAX_REGISTER_WINDOW) return false;
+
+    RegisterGenerator generator;
+    generator.vm = vm;
+    generator.chunk = chunk;
+    generator.capacity = 0;
+    generator.slots = ALLOCATE(vm, MEM_COMPILER, uint16_t, chunk->maxStack + 1); // Plus the slot a superinstruction's constant goes in
+    chunk->registerCode = NULL;
+    chunk->registerOrigins = NULL;
+    chunk->registerCount = 0;
+
+    bool translated = translateChunk(&generator);
+    FREE_ARRAY(vm, MEM_COMPILER, uint16_t, generator.slots, chunk->maxStack + 1);
+
+    if (!translated) {
+        chunk->registerCount = generator.capacity; // So freeRegisterCode() frees all of it
+        freeRegisterCode(vm, chunk);
+        return false;
+    }
+
+    // Shrink to fit, since freeRegisterCode() only knows the count
+    chunk->registerCode = GROW_ARRAY(vm, MEM_CODE, RegisterInstruction, chunk->registerCode, generator.capacity, chunk->registerCount);
+    chunk->registerOrigins = GROW_ARRAY(vm, MEM_CODE, int, chunk->registerOrigins, generator.capacity, chunk->registerCount);
+    return true;
+}
+#endif
@@ -4,6 +4,10 @@
 #include "object.h"
 #include "vm.h"
 
-bool compile(const char* source, Chunk* chunk); // Returns whether or not compilation suceeded
+bool compile(VM* vm, const char* source, Chunk* chunk); // Returns whether or not compilation suceeded
+void markCompilerRoots(VM* vm);
+#ifdef REGISTER_VM_ENABLED
+bool generateRegisterCode(VM* vm, Chunk* chunk); // Returns false if the chunk can't be translated, and leaves it with no register code
+#endif
 
 #endif
\ No newline at end of file
@@ -3,6 +3,46 @@
 #include "debug.h"
 #include "value.h"
 
+static const char* opcodeNames[] = {
+    [OP_CONSTANT]              = "OP_CONSTANT",
+    [OP_CONSTANT_LONG]         = "OP_CONSTANT_LONG",
+    [OP_NIL]                   = "OP_NIL",
+    [OP_TRUE]                  = "OP_TRUE",
+    [OP_FALSE]                 = "OP_FALSE",
+    [OP_EQUAL]                 = "OP_EQUAL",
+    [OP_GREATER]               = "OP_GREATER",
+    [OP_LESS]                  = "OP_LESS",
+    [OP_ADD]                   = "OP_ADD",
+    [OP_SUBTRACT]              = "OP_SUBTRACT",
+    [OP_MULTIPLY]              = "OP_MULTIPLY",
+    [OP_DIVIDE]                = "OP_DIVIDE",
+    [OP_NOT]                   = "OP_NOT",
+    [OP_NEGATE]                = "OP_NEGATE",
+    [OP_RETURN]                = "OP_RETURN",
+    [OP_NOT_EQUAL]             = "OP_NOT_EQUAL",
+    [OP_GREATER_EQUAL]         = "OP_GREATER_EQUAL",
+    [OP_LESS_EQUAL]            = "OP_LESS_EQUAL",
+    [OP_ADD_CONSTANT]          = "OP_ADD_CONSTANT",
+    [OP_SUBTRACT_CONSTANT]     = "OP_SUBTRACT_CONSTANT",
+    [OP_MULTIPLY_CONSTANT]     = "OP_MULTIPLY_CONSTANT",
+    [OP_DIVIDE_CONSTANT]       = "OP_DIVIDE_CONSTANT",
+    [OP_CONCAT]                = "OP_CONCAT",
+    [OP_ADD_NUM]               = "OP_ADD_NUM",
+    [OP_ADD_STR]               = "OP_ADD_STR",
+    [OP_EQUAL_NUM]             = "OP_EQUAL_NUM",
+    [OP_NOT_EQUAL_NUM]         = "OP_NOT_EQUAL_NUM",
+    [OP_ADD_CONSTANT_NUM]      = "OP_ADD_CONSTANT_NUM",
+    [OP_SUBTRACT_CONSTANT_NUM] = "OP_SUBTRACT_CONSTANT_NUM",
+    [OP_MULTIPLY_CONSTANT_NUM] = "OP_MULTIPLY_CONSTANT_NUM",
+    [OP_DIVIDE_CONSTANT_NUM]   = "OP_DIVIDE_CONSTANT_NUM",
+};
+
+// Name of an opcode, for reports that aren't a full disassembly
+const char* opcodeName(uint8_t opcode) {
+    if (opcode >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) || opcodeNames[opcode] == NULL) return "OP_UNKNOWN";
+    return opcodeNames[opcode];
+}
+
 void disassembleChunk(Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
 
@@ -19,6 +59,21 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2; // OP_CONSTANT is 2 bytes (one for the opcode and one for the operand), hence why we increment by 2.
 }
 
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t* operand = &chunk->code[offset + 1];
+    int constant = operand[0] | (operand[1] << 8) | (operand[2] << 16); // 24-bit index, lowest byte first
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+static int byteInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t operand = chunk->code[offset + 1];
+    printf("%-16s %4d\n", name, operand);
+    return offset + 2;
+}
+
 static int simpleInstruction(const char* name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -26,16 +81,19 @@ static int simpleInstruction(const char* name, int offset) {
 
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset); // Print offset position of instruction
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | "); // If same line as previous instruction, print this.
     } else {
-       printf("%4d ", chunk->lines[offset]); // Else, print the line number.
+       printf("%4d ", line); // Else, print the line number.
     }
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
         case OP_NIL:
             return simpleInstruction("OP_NIL", offset);
         case OP_TRUE:
@@ -62,8 +120,165 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_NEGATE", offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
+        case OP_ADD_CONSTANT:
+            return constantInstruction("OP_ADD_CONSTANT", chunk, offset);
+        case OP_SUBTRACT_CONSTANT:
+            return constantInstruction("OP_SUBTRACT_CONSTANT", chunk, offset);
+        case OP_MULTIPLY_CONSTANT:
+            return constantInstruction("OP_MULTIPLY_CONSTANT", chunk, offset);
+        case OP_DIVIDE_CONSTANT:
+            return constantInstruction("OP_DIVIDE_CONSTANT", chunk, offset);
+        case OP_CONCAT:
+            return byteInstruction("OP_CONCAT", chunk, offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+            return simpleInstruction("OP_ADD_STR", offset);
+        case OP_EQUAL_NUM:
+            return simpleInstruction("OP_EQUAL_NUM", offset);
+        case OP_NOT_EQUAL_NUM:
+            return simpleInstruction("OP_NOT_EQUAL_NUM", offset);
+        case OP_ADD_CONSTANT_NUM:
+            return constantInstruction("OP_ADD_CONSTANT_NUM", chunk, offset);
+        case OP_SUBTRACT_CONSTANT_NUM:
+            return constantInstruction("OP_SUBTRACT_CONSTANT_NUM", chunk, offset);
+        case OP_MULTIPLY_CONSTANT_NUM:
+            return constantInstruction("OP_MULTIPLY_CONSTANT_NUM", chunk, offset);
+        case OP_DIVIDE_CONSTANT_NUM:
+            return constantInstruction("OP_DIVIDE_CONSTANT_NUM", chunk, offset);
         default:
-            printf("Unknown opcode %d\n");
+            printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
-}
\ No newline at end of file
+}
+
+#ifdef REGISTER_VM_ENABLED
+static const char* registerOpcodeNames[] = {
+    [ROP_LOADK]         = "ROP_LOADK",
+    [ROP_NIL]           = "ROP_NIL",
+    [ROP_TRUE]          = "ROP_TRUE",
+    [ROP_FALSE]         = "ROP_FALSE",
+    [ROP_EQUAL]         = "ROP_EQUAL",
+    [ROP_NOT_EQUAL]     = "ROP_NOT_EQUAL",
+    [ROP_GREATER]       = "ROP_GREATER",
+    [ROP_LESS]          = "ROP_LESS",
+    [ROP_GREATER_EQUAL] = "ROP_GREATER_EQUAL",
+    [ROP_LESS_EQUAL]    = "ROP_LESS_EQUAL",
+    [ROP_ADD]           = "ROP_ADD",
+    [ROP_SUBTRACT]      = "ROP_SUBTRACT",
+    [ROP_MULTIPLY]      = "ROP_MULTIPLY",
+    [ROP_DIVIDE]        = "ROP_DIVIDE",
+    [ROP_NOT]           = "ROP_NOT",
+    [ROP_NEGATE]        = "ROP_NEGATE",
+    [ROP_CONCAT]        = "ROP_CONCAT",
+    [ROP_RETURN]        = "ROP_RETURN",
+};
+
+void disassembleRegisterCode(Chunk* chunk, const char* name) {
+    printf("== %s ==\n", name);
+
+    for (int index = 0; index < chunk->registerCount; index++) {
+        disassembleRegisterInstruction(chunk, index);
+    }
+}
+
+// Registers print as r0, r1..., and constants as their value
+static void printOperand(Chunk* chunk, uint16_t operand) {
+    if (operand >= chunk->maxStack) {
+        printf(" '");
+        printValue(chunk->constants.values[operand - chunk->maxStack]);
+        printf("'");
+    } else {
+        printf(" r%d", operand);
+    }
+}
+
+// Register code has no offsets of its own, so the line is the one of the stack instruction it came from
+void disassembleRegisterInstruction(Chunk* chunk, int index) {
+    printf("%04d ", index);
+    int line = getLine(chunk, chunk->registerOrigins[index]);
+    if (index > 0 && line == getLine(chunk, chunk->registerOrigins[index - 1])) {
+        printf("   | ");
+    } else {
+       printf("%4d ", line);
+    }
+
+    RegisterInstruction* instruction = &chunk->registerCode[index];
+    printf("%-17s", registerOpcodeNames[instruction->opcode]);
+    switch (instruction->opcode) {
+        case ROP_LOADK: {
+            int constant = instruction->b | (instruction->c << 16);
+            printf(" r%d %d '", instruction->a, constant);
+            printValue(chunk->constants.values[constant]);
+            printf("'");
+            break;
+        }
+        case ROP_NIL:
+        case ROP_TRUE:
+        case ROP_FALSE:
+            printf(" r%d", instruction->a);
+            break;
+        case ROP_NOT:
+        case ROP_NEGATE:
+            printf(" r%d", instruction->a);
+            printOperand(chunk, instruction->b);
+            break;
+        case ROP_CONCAT:
+            printf(" r%d %d", instruction->a, instruction->b);
+            break;
+        case ROP_RETURN:
+            printOperand(chunk, instruction->b);
+            break;
+        default:
+            printf(" r%d", instruction->a);
+            printOperand(chunk, instruction->b);
+            printOperand(chunk, instruction->c);
+            break;
+    }
+    printf("\n");
+}
+#endif
+
+#ifdef DEBUG_COUNT_OPCODE_PAIRS
+#define TOP_PAIRS 20
+
+void countOpcodePair(OpcodePairs* pairs, uint8_t previous, uint8_t current) {
+    pairs->counts[previous][current]++;
+}
+
+// Prints the most common pairs, and what share of all the pairs they make up. A pair near the top is a good candidate for a superinstruction.
+void printOpcodePairs(OpcodePairs* pairs) {
+    unsigned long (*opcodePairs)[UINT8_MAX + 1] = pairs->counts;
+    unsigned long total = 0;
+    for (int a = 0; a <= UINT8_MAX; a++) {
+        for (int b = 0; b <= UINT8_MAX; b++) total += opcodePairs[a][b];
+    }
+    if (total == 0) return;
+
+    printf("== opcode pairs (%lu total) ==\n", total);
+    unsigned long previousCount = (unsigned long)-1;
+    int previousIndex = -1;
+    for (int rank = 0; rank < TOP_PAIRS; rank++) {
+        // Selection of the next biggest pair. Ties are ordered by index so every pair is printed once.
+        int best = -1;
+        for (int index = 0; index <= UINT16_MAX; index++) {
+            unsigned long count = opcodePairs[index >> 8][index & 0xFF];
+            if (count == 0) continue;
+            if (count > previousCount || (count == previousCount && index <= previousIndex)) continue;
+            if (best == -1 || count > opcodePairs[best >> 8][best & 0xFF]) best = index;
+        }
+        if (best == -1) break;
+
+        unsigned long count = opcodePairs[best >> 8][best & 0xFF];
+        printf("%10lu %5.1f%%  %s -> %s\n", count, 100.0 * count / total, opcodeName(best >> 8), opcodeName(best & 0xFF));
+        previousCount = count;
+        previousIndex = best;
+    }
+}
+#endif
\ No newline at end of file
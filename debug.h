@@ -5,5 +5,19 @@
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+const char* opcodeName(uint8_t opcode);
+#ifdef REGISTER_VM_ENABLED
+void disassembleRegisterCode(Chunk* chunk, const char* name);
+void disassembleRegisterInstruction(Chunk* chunk, int index);
+#endif
+
+#ifdef DEBUG_COUNT_OPCODE_PAIRS
+typedef struct {
+    unsigned long counts[UINT8_MAX + 1][UINT8_MAX + 1]; // counts[a][b] is how many times b ran right after a
+} OpcodePairs;
+
+void countOpcodePair(OpcodePairs* pairs, uint8_t previous, uint8_t current);
+void printOpcodePairs(OpcodePairs* pairs);
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,190 @@
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HASH_SSE2
+#endif
+
+/*
+  The string hash. It used to be FNV-1a, which does a multiply for every single byte, one after the other.
+  This one is built like XXH3: short strings (16 bytes or less, so most identifiers) are read as two overlapping words and
+  mixed with one 64x64 -> 128 bit multiply. Longer strings are eaten 16 bytes (a "stripe") at a time into two 64-bit accumulators.
+  Every stripe is xored with a different word of a secret, and every 16 stripes (a "block") the accumulators get scrambled.
+  SSE2 does a whole stripe in a handful of instructions, and the plain C version does exactly the same math, so both give the same hashes.
+
+  The secret comes from a seed, and every VM has its own. By default the seed is picked fresh every run, so nobody can precompute
+  a pile of strings that all land in the same bucket of the intern table. Define FIXED_HASH_SEED in common.h to get the same hashes on every run.
+
+  The table splits the hash into H2 (the low 7 bits) and H1 (the rest), so every bit matters. The last step is a full avalanche
+  that makes each input bit flip about half of the output bits.
+*/
+#define STRIPE_SIZE 16
+#define STRIPES_PER_BLOCK 16
+
+// Where things live in the secret. Stripe i of a block uses words i and i + 1, so the block needs STRIPES_PER_BLOCK + 1 of them.
+#define SECRET_SCRAMBLE (STRIPES_PER_BLOCK + 1)
+#define SECRET_LAST     (SECRET_SCRAMBLE + 2) // For the final (possibly overlapping) stripe
+#define SECRET_MERGE    (SECRET_LAST + 2)     // For folding the accumulators together
+#define SECRET_SHORT    (SECRET_MERGE + 2)    // For strings of 16 bytes or less. These are the last two words, so HASH_SECRET_WORDS is SECRET_SHORT + 2.
+
+#define PRIME32_1 0x9E3779B1u
+#define PRIME64_1 0x9E3779B185EBCA87ull
+#define PRIME64_2 0xC2B2AE3D27D4EB4Full
+
+// memcpy is how C spells an unaligned load. Compilers turn it into a single mov.
+static inline uint64_t read64(const uint8_t* bytes) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static inline uint32_t read32(const uint8_t* bytes) {
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+// Multiplies into 128 bits, then xors the halves together. The high half is where the good mixing ends up.
+static inline uint64_t foldedMultiply(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    // Schoolbook multiplication with 32-bit halves, for compilers without a 128-bit integer type
+    uint64_t loLo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    uint64_t hiLo = (a >> 32) * (b & 0xFFFFFFFF);
+    uint64_t loHi = (a & 0xFFFFFFFF) * (b >> 32);
+    uint64_t hiHi = (a >> 32) * (b >> 32);
+    uint64_t cross = (loLo >> 32) + (hiLo & 0xFFFFFFFF) + loHi;
+    uint64_t upper = (hiLo >> 32) + (cross >> 32) + hiHi;
+    uint64_t lower = (cross << 32) | (loLo & 0xFFFFFFFF);
+    return lower ^ upper;
+#endif
+}
+
+static inline uint32_t avalanche(uint64_t hash) {
+    hash ^= hash >> 37;
+    hash *= 0x165667919E3779F9ull;
+    hash ^= hash >> 32;
+    return (uint32_t)hash;
+}
+
+/*
+  Per 64-bit lane: xor the data with the key, multiply the two 32-bit halves of that together, and add it to the accumulator.
+  The raw data is also added to the *other* lane, so a key that happens to zero out half the product can't wipe out input.
+*/
+#ifdef HASH_SSE2
+static void accumulate(uint64_t* acc, const uint8_t* bytes, int stripes, const uint64_t* keys) {
+    __m128i sum = _mm_loadu_si128((const __m128i*)acc);
+    for (int i = 0; i < stripes; i++) {
+        __m128i data = _mm_loadu_si128((const __m128i*)(bytes + i * STRIPE_SIZE));
+        __m128i mixed = _mm_xor_si128(data, _mm_loadu_si128((const __m128i*)(keys + i)));
+        __m128i product = _mm_mul_epu32(mixed, _mm_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1))); // Low half times high half, in both lanes
+        __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        sum = _mm_add_epi64(sum, _mm_add_epi64(product, swapped));
+    }
+    _mm_storeu_si128((__m128i*)acc, sum);
+}
+
+// acc = (acc ^ (acc >> 47) ^ key) * PRIME32_1. SSE2 can only multiply 32 bits at a time, so the two halves are done separately.
+static void scramble(uint64_t* acc, const uint64_t* key) {
+    __m128i value = _mm_loadu_si128((const __m128i*)acc);
+    value = _mm_xor_si128(value, _mm_srli_epi64(value, 47));
+    value = _mm_xor_si128(value, _mm_loadu_si128((const __m128i*)key));
+
+    __m128i prime = _mm_set1_epi32((int)PRIME32_1);
+    __m128i low = _mm_mul_epu32(value, prime);
+    __m128i high = _mm_mul_epu32(_mm_shuffle_epi32(value, _MM_SHUFFLE(3, 3, 1, 1)), prime);
+    _mm_storeu_si128((__m128i*)acc, _mm_add_epi64(low, _mm_slli_epi64(high, 32)));
+}
+#else
+static void accumulate(uint64_t* acc, const uint8_t* bytes, int stripes, const uint64_t* keys) {
+    uint64_t acc0 = acc[0];
+    uint64_t acc1 = acc[1];
+    for (int i = 0; i < stripes; i++) {
+        uint64_t data0 = read64(bytes + i * STRIPE_SIZE);
+        uint64_t data1 = read64(bytes + i * STRIPE_SIZE + 8);
+        uint64_t mixed0 = data0 ^ keys[i];
+        uint64_t mixed1 = data1 ^ keys[i + 1];
+        acc0 += data1 + (mixed0 & 0xFFFFFFFF) * (mixed0 >> 32);
+        acc1 += data0 + (mixed1 & 0xFFFFFFFF) * (mixed1 >> 32);
+    }
+    acc[0] = acc0;
+    acc[1] = acc1;
+}
+
+static void scramble(uint64_t* acc, const uint64_t* key) {
+    for (int lane = 0; lane < 2; lane++) {
+        uint64_t value = acc[lane];
+        value ^= value >> 47;
+        value ^= key[lane];
+        acc[lane] = value * PRIME32_1;
+    }
+}
+#endif
+
+// Strings of 16 bytes or less. Two reads cover every byte (they overlap when the string is shorter than both of them together).
+static uint32_t hashShort(const uint64_t* secret, const uint8_t* bytes, int length) {
+    uint64_t low = 0;
+    uint64_t high = 0;
+    if (length >= 8) {
+        low = read64(bytes);
+        high = read64(bytes + length - 8);
+    } else if (length >= 4) {
+        low = read32(bytes);
+        high = read32(bytes + length - 4);
+    } else if (length > 0) {
+        low = ((uint64_t)bytes[0] << 16) | ((uint64_t)bytes[length >> 1] << 8) | bytes[length - 1];
+    }
+    // Adding the length keeps strings whose reads happen to look the same (like "a" and "aaa") apart
+    return avalanche(length * PRIME64_1 + foldedMultiply(low ^ secret[SECRET_SHORT], high ^ secret[SECRET_SHORT + 1]));
+}
+
+static uint32_t hashLong(const uint64_t* secret, const uint8_t* bytes, int length) {
+    uint64_t acc[2] = { PRIME64_1, PRIME64_2 };
+
+    // Always leave 1 to 16 bytes over. They get hashed as the last 16 bytes of the string, overlapping the stripe before if need be.
+    int stripes = (length - 1) / STRIPE_SIZE;
+    const uint8_t* current = bytes;
+    while (stripes >= STRIPES_PER_BLOCK) {
+        accumulate(acc, current, STRIPES_PER_BLOCK, secret);
+        scramble(acc, &secret[SECRET_SCRAMBLE]);
+        current += STRIPES_PER_BLOCK * STRIPE_SIZE;
+        stripes -= STRIPES_PER_BLOCK;
+    }
+    accumulate(acc, current, stripes, secret);
+    accumulate(acc, bytes + length - STRIPE_SIZE, 1, &secret[SECRET_LAST]);
+
+    return avalanche(length * PRIME64_1 + foldedMultiply(acc[0] ^ secret[SECRET_MERGE], acc[1] ^ secret[SECRET_MERGE + 1]));
+}
+
+uint32_t hashString(const uint64_t* secret, const char* key, int length) {
+    if (length <= STRIPE_SIZE) return hashShort(secret, (const uint8_t*)key, length);
+    return hashLong(secret, (const uint8_t*)key, length);
+}
+
+// SplitMix64. Turns a seed (even a bad one, like 0) into a stream of well mixed words for the secret.
+static uint64_t nextSecretWord(uint64_t* state) {
+    uint64_t word = (*state += 0x9E3779B97F4A7C15ull);
+    word = (word ^ (word >> 30)) * 0xBF58476D1CE4E5B9ull;
+    word = (word ^ (word >> 27)) * 0x94D049BB133111EBull;
+    return word ^ (word >> 31);
+}
+
+// Fills in a secret of HASH_SECRET_WORDS words. initVM() calls this before the VM makes any strings, and it never changes after that, because strings cache their hash.
+void seedHash(uint64_t* secret) {
+#ifdef FIXED_HASH_SEED
+    uint64_t state = FIXED_HASH_SEED;
+#else
+    // Not cryptographic, but it's different every run. ASLR moves the stack around, so the address of a local adds some too.
+    uint64_t state = (uint64_t)time(NULL);
+    state ^= (uint64_t)clock() << 32;
+    state ^= (uint64_t)(uintptr_t)&state;
+#endif
+    for (int i = 0; i < HASH_SECRET_WORDS; i++) {
+        secret[i] = nextSecretWord(&state);
+    }
+}
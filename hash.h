@@ -0,0 +1,11 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+#define HASH_SECRET_WORDS 25 // Size of the secret hashString() mixes the characters with (see hash.c)
+
+void seedHash(uint64_t* secret);
+uint32_t hashString(const uint64_t* secret, const char* key, int length);
+
+#endif
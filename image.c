@@ -0,0 +1,393 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+// No mmap on Windows, so images are read into a heap buffer there instead
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "compiler.h"
+#include "image.h"
+#include "memory.h"
+#include "object.h"
+
+/*
+  A bytecode image is a compiled chunk written to disk, so running it skips scanning and compiling entirely.
+  The layout is:
+    - An ImageHeader
+    - The code, one byte per byte (duh)
+    - The line table, as the chunk's LineStart runs (4-byte aligned)
+    - The constant pool. Each constant is a tag byte followed by its payload:
+      nothing for nil/false/true, a raw double for numbers, and a uint32_t length plus the characters for strings
+  Everything is in the byte order of the machine that wrote it. Loading maps the file into memory and points the chunk's
+  code and lines right at it, so nothing gets copied or parsed except the constants.
+  The mapping is private and writable, because running the program quickens its code in place (see vm.c). The first write to a page
+  copies it, so the file itself never changes.
+*/
+#define IMAGE_MAGIC "\x7FLOX" // 0x7F isn't a character Lox source can contain, so an image can never be mistaken for a script
+#define IMAGE_VERSION 8
+#define IMAGE_BYTE_ORDER 0x01020304 // Reads back scrambled on a machine with the other endianness
+
+typedef enum {
+    CONST_NIL,
+    CONST_FALSE,
+    CONST_TRUE,
+    CONST_NUMBER,
+    CONST_STRING,
+} ConstantTag;
+
+typedef struct {
+    char magic[4];
+    uint32_t version; // Bumped whenever the layout or the opcodes change
+    uint32_t byteOrder;
+    uint32_t codeCount;
+    uint32_t lineCount;
+    uint32_t constantCount;
+    uint32_t maxStack;
+    uint32_t codeOffset;
+    uint32_t linesOffset;
+    uint32_t constantsOffset;
+} ImageHeader;
+
+static uint32_t alignTo(uint32_t offset, uint32_t alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+// Pads the file with zeros until it's "offset" bytes long
+static void padTo(FILE* file, uint32_t offset) {
+    while ((uint32_t)ftell(file) < offset) fputc(0, file);
+}
+
+/*
+  run() trusts its code completely: it dispatches on every opcode through a table, indexes the constant pool with every operand, and
+  sizes the stack from maxStack with no bounds checks after that. Code from the compiler keeps those promises, but an image is just a
+  file, so its code is walked once before anything runs it. Returns the most values the code ever has on the stack, or -1 if any
+  instruction:
+    - has an opcode that doesn't exist
+    - has operands that run past the end of the code
+    - names a constant past the end of the pool (or, once quickened, a constant that isn't a number)
+    - pops more than the stack holds
+  or if the code doesn't end with its one and only OP_RETURN. There are no jumps, so walking straight through sees every instruction
+  with the stack depth it will actually run at.
+  writeImage() stores what this returns as the image's maxStack, and loadImage() only takes an image whose maxStack is exactly that.
+  (The compiler's own maxStack can be a little bigger, since folding takes values back off the stack after they were counted.)
+*/
+static int verifyCode(Chunk* chunk) {
+    const uint8_t* code = chunk->code;
+    int count = chunk->count;
+    int depth = 0;
+    int peak = 0;
+
+    for (int offset = 0; offset < count;) {
+        uint8_t instruction = code[offset];
+        int length = 1;
+        int needed = 0;        // How many values it has to find on the stack
+        int effect = 0;        // How much it changes the depth by
+        int spare = 0;         // Slots it uses above its result for a moment
+        int constantBytes = 0; // How wide its constant index is, if it has one
+        bool numberConstant = false;
+
+        switch (instruction) {
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                effect = 1;
+                break;
+            case OP_CONSTANT:      length = 2; effect = 1; constantBytes = 1; break;
+            case OP_CONSTANT_LONG: length = 4; effect = 1; constantBytes = 3; break;
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_NOT_EQUAL:
+            case OP_GREATER_EQUAL:
+            case OP_LESS_EQUAL:
+            case OP_ADD_NUM:
+            case OP_ADD_STR:
+            case OP_EQUAL_NUM:
+            case OP_NOT_EQUAL_NUM:
+                needed = 2;
+                effect = -1;
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+                needed = 1;
+                break;
+            case OP_ADD_CONSTANT_NUM:
+            case OP_SUBTRACT_CONSTANT_NUM:
+            case OP_MULTIPLY_CONSTANT_NUM:
+            case OP_DIVIDE_CONSTANT_NUM:
+                numberConstant = true; // These skip checking the constant's type
+                // Fallthrough
+            case OP_ADD_CONSTANT:
+            case OP_SUBTRACT_CONSTANT:
+            case OP_MULTIPLY_CONSTANT:
+            case OP_DIVIDE_CONSTANT:
+                // The top is replaced in place, but OP_ADD_CONSTANT puts the constant on the stack for a moment to concatenate strings
+                length = 2;
+                needed = 1;
+                spare = 1;
+                constantBytes = 1;
+                break;
+            case OP_CONCAT:
+                if (offset + 1 >= count) return -1;
+                length = 2;
+                needed = code[offset + 1];
+                if (needed < 2) return -1; // The compiler only makes a chain out of two or more
+                effect = 1 - needed;
+                break;
+            case OP_RETURN:
+                // The result gets printed, so there has to be one, and nothing can come after it
+                return depth >= 1 && offset == count - 1 ? peak : -1;
+            default:
+                return -1; // Unknown opcode
+        }
+
+        if (offset + length > count) return -1;
+        if (constantBytes > 0) {
+            int index = constantBytes == 1 ? code[offset + 1] : code[offset + 1] | (code[offset + 2] << 8) | (code[offset + 3] << 16);
+            if (index >= chunk->constants.count) return -1;
+            // Strings are still nil placeholders at this point, so this only lets real numbers through
+            if (numberConstant && !IS_NUMBER(chunk->constants.values[index])) return -1;
+        }
+        if (depth < needed) return -1;
+        int reached = depth + (effect > spare ? effect : spare);
+        if (reached > peak) peak = reached;
+
+        depth += effect;
+        offset += length;
+    }
+
+    return -1; // Ran off the end without an OP_RETURN
+}
+
+bool writeImage(Chunk* chunk, const char* path) {
+    int maxStack = verifyCode(chunk);
+    if (maxStack < 0) return false; // Can't happen with code from the compiler, but then the image wouldn't load anyway
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) return false;
+
+    ImageHeader header;
+    memcpy(header.magic, IMAGE_MAGIC, 4);
+    header.version = IMAGE_VERSION;
+    header.byteOrder = IMAGE_BYTE_ORDER;
+    header.codeCount = (uint32_t)chunk->count;
+    header.lineCount = (uint32_t)chunk->lineCount;
+    header.constantCount = (uint32_t)chunk->constants.count;
+    header.maxStack = (uint32_t)maxStack;
+    header.codeOffset = sizeof(ImageHeader);
+    header.linesOffset = alignTo(header.codeOffset + header.codeCount, sizeof(int));
+    header.constantsOffset = header.linesOffset + header.lineCount * sizeof(LineStart);
+    fwrite(&header, sizeof(ImageHeader), 1, file);
+
+    fwrite(chunk->code, sizeof(uint8_t), chunk->count, file);
+    padTo(file, header.linesOffset);
+    fwrite(chunk->lines, sizeof(LineStart), chunk->lineCount, file);
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_NIL(value)) {
+            fputc(CONST_NIL, file);
+        } else if (IS_BOOL(value)) {
+            fputc(AS_BOOL(value) ? CONST_TRUE : CONST_FALSE, file);
+        } else if (IS_NUMBER(value)) {
+            double number = AS_NUMBER(value);
+            fputc(CONST_NUMBER, file);
+            fwrite(&number, sizeof(double), 1, file);
+        } else {
+            ObjString* string = AS_STRING(value); // Strings are the only objects that end up in a constant pool
+            uint32_t length = (uint32_t)string->length;
+            fputc(CONST_STRING, file);
+            fwrite(&length, sizeof(uint32_t), 1, file);
+            fwrite(string->chars, sizeof(char), string->length, file);
+        }
+    }
+
+    bool succeeded = !ferror(file);
+    if (fclose(file) != 0) succeeded = false;
+    return succeeded;
+}
+
+bool isImageFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return false;
+
+    char magic[4];
+    bool isImage = fread(magic, sizeof(char), 4, file) == 4 && memcmp(magic, IMAGE_MAGIC, 4) == 0;
+    fclose(file);
+    return isImage;
+}
+
+// Maps a whole file into memory (copy on write). Returns NULL if it can't.
+static uint8_t* mapFile(const char* path, size_t* size) {
+#ifdef _WIN32
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+
+    uint8_t* buffer = (uint8_t*)malloc(*size);
+    if (buffer == NULL || fread(buffer, sizeof(uint8_t), *size, file) < *size) {
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+    return buffer;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat status;
+    if (fstat(fd, &status) < 0 || status.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    *size = (size_t)status.st_size;
+    void* image = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file alive by itself
+    return image == MAP_FAILED ? NULL : (uint8_t*)image;
+#endif
+}
+
+static void unmapFile(uint8_t* image, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    free(image);
+#else
+    munmap(image, size);
+#endif
+}
+
+/*
+  Walks the constant pool section. The first pass ("resolveStrings" false) fills in the pool, with nil standing in for every string.
+  The second pass ("resolveStrings" true) interns the strings into their slots and leaves everything else alone.
+  Returns false if the section runs off the end of the image.
+*/
+static bool readConstants(VM* vm, Program* program, bool resolveStrings) {
+    ImageHeader* header = (ImageHeader*)program->image;
+    const uint8_t* current = program->image + header->constantsOffset;
+    const uint8_t* end = program->image + program->imageSize;
+
+    for (uint32_t i = 0; i < header->constantCount; i++) {
+        if (current >= end) return false;
+
+        Value value = NIL_VAL;
+        switch (*current++) {
+            case CONST_NIL:   break;
+            case CONST_FALSE: value = BOOL_VAL(false); break;
+            case CONST_TRUE:  value = BOOL_VAL(true); break;
+            case CONST_NUMBER: {
+                if (end - current < (long)sizeof(double)) return false;
+                double number;
+                memcpy(&number, current, sizeof(double)); // memcpy because the double isn't aligned
+                current += sizeof(double);
+                value = NUMBER_VAL(number);
+                break;
+            }
+            case CONST_STRING: {
+                if (end - current < (long)sizeof(uint32_t)) return false;
+                uint32_t length;
+                memcpy(&length, current, sizeof(uint32_t));
+                current += sizeof(uint32_t);
+                if ((uint32_t)(end - current) < length) return false;
+
+                if (resolveStrings) {
+                    // The string is copied straight out of the mapped file. Storing it in the pool right away keeps it reachable.
+                    program->chunk.constants.values[i] = OBJ_VAL(copyString(vm, (const char*)current, (int)length));
+                }
+                current += length;
+                break; // On the first pass, the string's slot gets nil as a placeholder
+            }
+            default:
+                return false; // Unknown tag
+        }
+
+        if (!resolveStrings) writeValueArray(vm, &program->chunk.constants, value);
+    }
+
+    return true;
+}
+
+/*
+  Loads an image. The chunk's code and line table point straight into the mapped file, so they're never copied.
+  String constants are left as nil until the program is first run (see resolveImageStrings()), so loading doesn't intern anything.
+*/
+Program* loadImage(VM* vm, const char* path) {
+    size_t size;
+    uint8_t* image = mapFile(path, &size);
+    if (image == NULL) return NULL;
+
+    ImageHeader* header = (ImageHeader*)image;
+    if (size < sizeof(ImageHeader) ||
+        memcmp(header->magic, IMAGE_MAGIC, 4) != 0 ||
+        header->version != IMAGE_VERSION ||
+        header->byteOrder != IMAGE_BYTE_ORDER ||
+        header->codeCount == 0 ||
+        header->maxStack > INT_MAX ||
+        header->codeOffset < sizeof(ImageHeader) ||
+        (size_t)header->codeOffset + header->codeCount > size ||
+        header->lineCount == 0 ||
+        header->lineCount > header->codeCount ||
+        header->linesOffset % sizeof(int) != 0 ||
+        (size_t)header->linesOffset + (size_t)header->lineCount * sizeof(LineStart) > size ||
+        header->constantsOffset > size) {
+        unmapFile(image, size);
+        return NULL;
+    }
+
+    Program* program = newProgram(vm);
+    program->image = image;
+    program->imageSize = size;
+    program->hasPendingStrings = true;
+
+    Chunk* chunk = &program->chunk;
+    chunk->code = image + header->codeOffset;
+    chunk->lines = (LineStart*)(image + header->linesOffset);
+    chunk->lineCount = (int)header->lineCount;
+    chunk->count = (int)header->codeCount;
+    chunk->maxStack = (int)header->maxStack;
+    chunk->capacity = 0; // The chunk doesn't own its code or lines, the mapping does
+    chunk->lineCapacity = 0;
+
+    // A maxStack that's too small would let the code write past the stack, and one that's too big would make runProgram() try to
+    // allocate it (or overflow working out how much)
+    if (!readConstants(vm, program, false) || verifyCode(chunk) != chunk->maxStack) {
+        freeProgram(vm, program);
+        return NULL;
+    }
+#ifdef REGISTER_VM_ENABLED
+    generateRegisterCode(vm, chunk); // Only looks at the constants' indexes, so the strings don't need to be there yet
+#endif
+    return program;
+}
+
+// Interns the string constants of a loaded image. Runs once, the first time the program is run.
+void resolveImageStrings(VM* vm, Program* program) {
+    readConstants(vm, program, true); // Already validated by loadImage()
+    program->hasPendingStrings = false;
+}
+
+// Frees what a loaded program owns: its constant pool and the mapping itself
+void freeImage(VM* vm, Program* program) {
+    freeValueArray(vm, &program->chunk.constants);
+#ifdef REGISTER_VM_ENABLED
+    freeRegisterCode(vm, &program->chunk); // Unlike the code it came from, this is on the heap
+#endif
+    unmapFile(program->image, program->imageSize);
+    program->image = NULL;
+}
\ No newline at end of file
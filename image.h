@@ -0,0 +1,13 @@
+#ifndef clox_image_h
+#define clox_image_h
+
+#include "chunk.h"
+#include "vm.h"
+
+bool writeImage(Chunk* chunk, const char* path); // Returns whether or not the image was written
+bool isImageFile(const char* path);
+Program* loadImage(VM* vm, const char* path); // Returns NULL if the file can't be read or isn't a valid image
+void resolveImageStrings(VM* vm, Program* program);
+void freeImage(VM* vm, Program* program);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,613 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS isn't in strict C99 mode otherwise
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "jit.h"
+
+#ifdef JIT_ENABLED
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON // Older BSDs and macOS
+#endif
+
+#include "object.h"
+#include "vm.h"
+
+/*
+  A baseline template JIT. Every instruction in the chunk gets turned into a fixed snippet of x86-64, one after the other,
+  so none of run()'s decoding or dispatching happens at all. Numbers are handled right there in the machine code with SSE2.
+  Anything else (strings, ropes, ==, OP_CONCAT, runtime errors, printing) calls one of the small C helpers below.
+
+  Chunks are straight-line code (there are no jumps yet), so the stack depth before every instruction is known while compiling.
+  That means the machine code never keeps a stack top around: every value lives at a fixed offset from the bottom of vm->stack.
+
+  While the machine code runs:
+    r12 = VM*
+    r13 = vm->stack
+    r14 = QNAN, to test for numbers with
+  All three are callee-saved, so they survive calls into C.
+
+  The machine code is an InterpretResult (*)(VM* vm, Value* stack). runProgram() calls it instead of run() once a program is hot.
+*/
+
+typedef InterpretResult (*JitFunction)(VM* vm, Value* stack);
+typedef void (*JitHelper)(void); // Any of the C helpers, whatever its real signature is. Only ever called from machine code.
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+} Register;
+
+// The machine code gets built up in a plain malloc'd buffer, and only copied into executable memory once it's finished
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+} Assembler;
+
+static void emitByte(Assembler* as, uint8_t byte) {
+    if (as->count == as->capacity) {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->code = (uint8_t*)realloc(as->code, as->capacity);
+        if (as->code == NULL) exit(1);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emitBytes(Assembler* as, const uint8_t* bytes, int count) {
+    for (int i = 0; i < count; i++) emitByte(as, bytes[i]);
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emitByte(as, (uint8_t)(value >> (i * 8)));
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emitByte(as, (uint8_t)(value >> (i * 8)));
+}
+
+// The REX prefix. W picks 64-bit operands, and R and B hold the 4th bit of the registers in the ModRM byte's reg and rm fields.
+static uint8_t rex(bool wide, Register reg, Register rm) {
+    return 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+}
+
+static uint8_t modrm(int mod, int reg, int rm) {
+    return (uint8_t)((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+/*
+  [r13 + disp32], the stack slot "slot" values up from the bottom. r13's low bits are 101, which with mod 00 would mean
+  RIP-relative, but mod 10 (32-bit displacement) is always a plain base register. That's also why the stack lives in r13 and not r12 (which needs a SIB byte).
+*/
+static void emitSlot(Assembler* as, int reg, int slot) {
+    emitByte(as, modrm(2, reg, R13));
+    emit32(as, (uint32_t)(slot * (int)sizeof(Value)));
+}
+
+// mov reg, imm64
+static void emitLoadImmediate(Assembler* as, Register reg, uint64_t value) {
+    emitByte(as, rex(true, 0, reg));
+    emitByte(as, 0xB8 + (reg & 7));
+    emit64(as, value);
+}
+
+// mov reg, [slot]
+static void emitLoadSlot(Assembler* as, Register reg, int slot) {
+    emitByte(as, rex(true, reg, R13));
+    emitByte(as, 0x8B);
+    emitSlot(as, reg, slot);
+}
+
+// mov [slot], reg
+static void emitStoreSlot(Assembler* as, int slot, Register reg) {
+    emitByte(as, rex(true, reg, R13));
+    emitByte(as, 0x89);
+    emitSlot(as, reg, slot);
+}
+
+// lea reg, [slot]. Used to hand the helpers a pointer into the stack.
+static void emitSlotAddress(Assembler* as, Register reg, int slot) {
+    emitByte(as, rex(true, reg, R13));
+    emitByte(as, 0x8D);
+    emitSlot(as, reg, slot);
+}
+
+// Register to register ALU instruction (mov, and, cmp...), dst = dst op src
+static void emitRegisterOp(Assembler* as, uint8_t opcode, Register dst, Register src) {
+    emitByte(as, rex(true, src, dst));
+    emitByte(as, opcode);
+    emitByte(as, modrm(3, src, dst));
+}
+
+#define OPCODE_MOV 0x89
+#define OPCODE_ADD 0x01
+#define OPCODE_AND 0x21
+#define OPCODE_CMP 0x39
+
+// mov r32, imm32. Writing the low half zeroes the upper half, so this also works for small unsigned 64-bit arguments.
+static void emitLoadInt(Assembler* as, Register reg, uint32_t value) {
+    if (reg & 8) emitByte(as, rex(false, 0, reg));
+    emitByte(as, 0xB8 + (reg & 7));
+    emit32(as, value);
+}
+
+// SSE2 scalar double instruction with a stack slot operand (movsd, addsd, ucomisd...). Only xmm0 and xmm1 get used, so no REX.R is ever needed.
+static void emitSseSlot(Assembler* as, uint8_t prefix, uint8_t opcode, int xmm, int slot) {
+    emitByte(as, prefix);
+    emitByte(as, rex(false, 0, R13));
+    emitByte(as, 0x0F);
+    emitByte(as, opcode);
+    emitSlot(as, xmm, slot);
+}
+
+// Same thing with xmm registers on both sides
+static void emitSseRegister(Assembler* as, uint8_t prefix, uint8_t opcode, int dst, int src) {
+    emitByte(as, prefix);
+    emitByte(as, 0x0F);
+    emitByte(as, opcode);
+    emitByte(as, modrm(3, dst, src));
+}
+
+#define SSE_DOUBLE 0xF2 // The movsd/addsd/... prefix
+#define SSE_PACKED 0x66 // The ucomisd/movq prefix
+#define SSE_LOAD   0x10
+#define SSE_STORE  0x11
+#define SSE_ADD    0x58
+#define SSE_MUL    0x59
+#define SSE_SUB    0x5C
+#define SSE_DIV    0x5E
+#define SSE_UCOMI  0x2E
+
+// movq xmm, reg
+static void emitMoveToXmm(Assembler* as, int xmm, Register reg) {
+    emitByte(as, SSE_PACKED);
+    emitByte(as, rex(true, 0, reg));
+    emitByte(as, 0x0F);
+    emitByte(as, 0x6E);
+    emitByte(as, modrm(3, xmm, reg));
+}
+
+// Calls a C function. Helpers can be anywhere in the address space, so the address goes through rax instead of a rel32.
+static void emitCall(Assembler* as, JitHelper function) {
+    emitLoadImmediate(as, RAX, (uint64_t)(uintptr_t)function);
+    emitByte(as, 0xFF);
+    emitByte(as, 0xD0); // call rax
+}
+
+#define JUMP_ALWAYS 0xE9
+#define JUMP_IF_EQUAL 0x84
+
+// Emits a jump with a placeholder target, and returns where the placeholder is, so patchJump() can fill it in later
+static int emitJump(Assembler* as, uint8_t condition) {
+    if (condition != JUMP_ALWAYS) emitByte(as, 0x0F);
+    emitByte(as, condition);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+// Points the jump at "target". rel32 is counted from the end of the jump instruction, which is right after the placeholder.
+static void patchJumpTo(Assembler* as, int placeholder, int target) {
+    uint32_t distance = (uint32_t)(target - (placeholder + 4));
+    memcpy(&as->code[placeholder], &distance, sizeof(distance));
+}
+
+// Points the jump at the code that's about to be emitted. -1 means there was no jump to patch.
+static void patchJump(Assembler* as, int placeholder) {
+    if (placeholder < 0) return;
+    patchJumpTo(as, placeholder, as->count);
+}
+
+static void emitJumpTo(Assembler* as, uint8_t condition, int target) {
+    patchJumpTo(as, emitJump(as, condition), target);
+}
+
+/*
+  Jumps to "fail" (returned as a placeholder) unless the value in "slot" is a number. Same test as IS_NUMBER(): are all the quiet NaN bits set?
+  If the compiler already knows the slot holds a number, there's nothing to check, and this returns -1 without emitting anything.
+*/
+static int emitNumberCheck(Assembler* as, const bool* numbers, int slot) {
+    if (numbers[slot]) return -1;
+    emitLoadSlot(as, RAX, slot);
+    emitRegisterOp(as, OPCODE_AND, RAX, R14);
+    emitRegisterOp(as, OPCODE_CMP, RAX, R14);
+    return emitJump(as, JUMP_IF_EQUAL);
+}
+
+// Turns the 0 or 1 in al into a boolean Value. FALSE_VAL and TRUE_VAL only differ in the lowest bit, so it's just an add.
+static void emitBoolFromAl(Assembler* as, bool negate, int slot) {
+    if (negate) {
+        static const uint8_t xorAl[] = { 0x34, 0x01 }; // xor al, 1
+        emitBytes(as, xorAl, sizeof(xorAl));
+    }
+    static const uint8_t zeroExtend[] = { 0x0F, 0xB6, 0xC0 }; // movzx eax, al
+    emitBytes(as, zeroExtend, sizeof(zeroExtend));
+    emitLoadImmediate(as, RCX, FALSE_VAL);
+    emitRegisterOp(as, OPCODE_ADD, RAX, RCX);
+    emitStoreSlot(as, slot, RAX);
+}
+
+// Where a runtime error happened. run() has always read an instruction's operands by the time it reports an error, so vm->ip points past them.
+static void setErrorLocation(VM* vm, int next) {
+    vm->ip = vm->chunk->code + next;
+}
+
+/*
+  The helpers. The machine code always passes them "top", a pointer to the slot just past the instruction's operands,
+  and they store it as vm->stackTop before doing anything. That keeps the operands in the GC's sight while they allocate.
+  The ones that can fail return false after reporting the error, and the machine code bails out with INTERPRET_RUNTIME_ERROR.
+*/
+static void jitError(VM* vm, int next, const char* message) {
+    setErrorLocation(vm, next);
+    runtimeError(vm, "%s", message);
+}
+
+// OP_ADD when the operands aren't both numbers
+static bool jitAdd(VM* vm, Value* top, int next) {
+    vm->stackTop = top;
+    if (IS_ANY_STRING(top[-2]) && IS_ANY_STRING(top[-1])) {
+        top[-2] = OBJ_VAL(concatenateStrings(vm, AS_OBJ(top[-2]), AS_OBJ(top[-1])));
+        return true;
+    }
+    jitError(vm, next, "Operands must be two numbers or two strings.");
+    return false;
+}
+
+// OP_ADD_CONSTANT when the operand isn't a number, or the constant isn't
+static bool jitAddConstant(VM* vm, Value* top, int next, Value constant) {
+    vm->stackTop = top;
+    if (IS_NUMBER(top[-1]) && IS_NUMBER(constant)) {
+        top[-1] = NUMBER_VAL(AS_NUMBER(top[-1]) + AS_NUMBER(constant));
+        return true;
+    }
+    if (IS_ANY_STRING(top[-1]) && IS_STRING(constant)) {
+        top[-1] = OBJ_VAL(concatenateStrings(vm, AS_OBJ(top[-1]), AS_OBJ(constant))); // The constant is kept alive by the constant pool
+        return true;
+    }
+    jitError(vm, next, "Operands must be two numbers or two strings.");
+    return false;
+}
+
+// OP_EQUAL and OP_NOT_EQUAL when the operands aren't both numbers. Can't fail.
+static void jitEqual(VM* vm, Value* top, bool negate) {
+    vm->stackTop = top;
+    top[-1] = flattenValue(vm, top[-1]);
+    top[-2] = flattenValue(vm, top[-2]);
+    top[-2] = BOOL_VAL(valuesEqual(top[-2], top[-1]) != negate);
+}
+
+static bool jitConcat(VM* vm, Value* top, int count, int next) {
+    vm->stackTop = top;
+    if (concatenateValues(vm, count)) return true;
+    jitError(vm, next, "Operands must be two numbers or two strings.");
+    return false;
+}
+
+static void jitReturn(VM* vm, Value* top) {
+    printValue(top[-1]);
+    printf("\n");
+    vm->stackTop = top - 1;
+}
+
+// Calls a helper that returns a bool, and bails out to "errorExit" if it returned false
+static void emitFallibleCall(Assembler* as, JitHelper helper, int errorExit) {
+    emitCall(as, helper);
+    static const uint8_t testAl[] = { 0x84, 0xC0 }; // test al, al
+    emitBytes(as, testAl, sizeof(testAl));
+    emitJumpTo(as, JUMP_IF_EQUAL, errorExit);
+}
+
+// Reports "message" for the instruction ending at "next", then bails out
+static void emitError(Assembler* as, int next, const char* message, int errorExit) {
+    emitRegisterOp(as, OPCODE_MOV, RDI, R12);
+    emitLoadInt(as, RSI, (uint32_t)next);
+    emitLoadImmediate(as, RDX, (uint64_t)(uintptr_t)message);
+    emitCall(as, (JitHelper)jitError);
+    emitJumpTo(as, JUMP_ALWAYS, errorExit);
+}
+
+// OP_ADD, OP_SUBTRACT, OP_MULTIPLY and OP_DIVIDE. The result replaces the left operand.
+static void emitArithmetic(Assembler* as, bool* numbers, uint8_t sseOpcode, int left, int next, int errorExit) {
+    int leftFails = emitNumberCheck(as, numbers, left);
+    int rightFails = emitNumberCheck(as, numbers, left + 1);
+    emitSseSlot(as, SSE_DOUBLE, SSE_LOAD, 0, left);
+    emitSseSlot(as, SSE_DOUBLE, sseOpcode, 0, left + 1);
+    emitSseSlot(as, SSE_DOUBLE, SSE_STORE, 0, left);
+
+    // Anything but + fails when it isn't given numbers, so only + can leave something else behind
+    bool bothNumbers = numbers[left] && numbers[left + 1];
+    numbers[left] = bothNumbers || sseOpcode != SSE_ADD;
+    if (bothNumbers) return;
+    int done = emitJump(as, JUMP_ALWAYS);
+
+    patchJump(as, leftFails);
+    patchJump(as, rightFails);
+    if (sseOpcode == SSE_ADD) {
+        emitRegisterOp(as, OPCODE_MOV, RDI, R12);
+        emitSlotAddress(as, RSI, left + 2);
+        emitLoadInt(as, RDX, (uint32_t)next);
+        emitFallibleCall(as, (JitHelper)jitAdd, errorExit);
+    } else {
+        emitError(as, next, "Operands must be numbers.", errorExit);
+    }
+    patchJump(as, done);
+}
+
+/*
+  The comparisons. ucomisd sets the flags like an unsigned compare, and "above" is false when either side is NaN, which is what C's > does.
+  a < b is done as b > a. >= and <= are the opposite comparison negated, the same way run() does them.
+*/
+static void emitComparison(Assembler* as, bool* numbers, bool swap, bool negate, int left, int next, int errorExit) {
+    int leftFails = emitNumberCheck(as, numbers, left);
+    int rightFails = emitNumberCheck(as, numbers, left + 1);
+    emitSseSlot(as, SSE_DOUBLE, SSE_LOAD, 0, swap ? left + 1 : left);
+    emitSseSlot(as, SSE_PACKED, SSE_UCOMI, 0, swap ? left : left + 1);
+    static const uint8_t setAbove[] = { 0x0F, 0x97, 0xC0 }; // seta al
+    emitBytes(as, setAbove, sizeof(setAbove));
+    emitBoolFromAl(as, negate, left);
+
+    bool bothNumbers = numbers[left] && numbers[left + 1];
+    numbers[left] = false;
+    if (bothNumbers) return;
+    int done = emitJump(as, JUMP_ALWAYS);
+
+    patchJump(as, leftFails);
+    patchJump(as, rightFails);
+    emitError(as, next, "Operands must be numbers.", errorExit);
+    patchJump(as, done);
+}
+
+// Two numbers are equal when ucomisd says so and neither is NaN (NaN sets the parity flag). Anything else goes through valuesEqual().
+static void emitEquality(Assembler* as, bool* numbers, bool negate, int left) {
+    int leftFails = emitNumberCheck(as, numbers, left);
+    int rightFails = emitNumberCheck(as, numbers, left + 1);
+    emitSseSlot(as, SSE_DOUBLE, SSE_LOAD, 0, left);
+    emitSseSlot(as, SSE_PACKED, SSE_UCOMI, 0, left + 1);
+    static const uint8_t setEqualAndOrdered[] = {
+        0x0F, 0x94, 0xC0, // sete al
+        0x0F, 0x9B, 0xC1, // setnp cl
+        0x20, 0xC8,       // and al, cl
+    };
+    emitBytes(as, setEqualAndOrdered, sizeof(setEqualAndOrdered));
+    emitBoolFromAl(as, negate, left);
+
+    bool bothNumbers = numbers[left] && numbers[left + 1];
+    numbers[left] = false;
+    if (bothNumbers) return;
+    int done = emitJump(as, JUMP_ALWAYS);
+
+    patchJump(as, leftFails);
+    patchJump(as, rightFails);
+    emitRegisterOp(as, OPCODE_MOV, RDI, R12);
+    emitSlotAddress(as, RSI, left + 2);
+    emitLoadInt(as, RDX, negate ? 1 : 0);
+    emitCall(as, (JitHelper)jitEqual);
+    patchJump(as, done);
+}
+
+// What OP_*_CONSTANT does when the fast path can't handle it. Only + has anything to try (strings). The rest can only fail.
+static void emitConstantFallback(Assembler* as, uint8_t sseOpcode, Value constant, int slot, int next, int errorExit) {
+    if (sseOpcode == SSE_ADD) {
+        emitRegisterOp(as, OPCODE_MOV, RDI, R12);
+        emitSlotAddress(as, RSI, slot + 1);
+        emitLoadInt(as, RDX, (uint32_t)next);
+        emitLoadImmediate(as, RCX, constant);
+        emitFallibleCall(as, (JitHelper)jitAddConstant, errorExit);
+    } else {
+        emitError(as, next, "Operands must be numbers.", errorExit);
+    }
+}
+
+// OP_*_CONSTANT. The constant is known while compiling, so if it's a number it goes right into the code.
+static void emitConstantArithmetic(Assembler* as, bool* numbers, uint8_t sseOpcode, Value constant, int slot, int next, int errorExit) {
+    if (!IS_NUMBER(constant)) {
+        emitConstantFallback(as, sseOpcode, constant, slot, next, errorExit);
+        numbers[slot] = false; // A string, if it worked
+        return;
+    }
+
+    int fails = emitNumberCheck(as, numbers, slot);
+    emitSseSlot(as, SSE_DOUBLE, SSE_LOAD, 0, slot);
+    emitLoadImmediate(as, RCX, constant);
+    emitMoveToXmm(as, 1, RCX);
+    emitSseRegister(as, SSE_DOUBLE, sseOpcode, 0, 1);
+    emitSseSlot(as, SSE_DOUBLE, SSE_STORE, 0, slot);
+    if (fails < 0) return;
+
+    int done = emitJump(as, JUMP_ALWAYS);
+    patchJump(as, fails);
+    emitConstantFallback(as, sseOpcode, constant, slot, next, errorExit);
+    patchJump(as, done);
+    numbers[slot] = true; // With a number constant, the fallback can only fail
+}
+
+static void emitPushValue(Assembler* as, bool* numbers, Value value, int slot) {
+    emitLoadImmediate(as, RAX, value);
+    emitStoreSlot(as, slot, RAX);
+    numbers[slot] = IS_NUMBER(value);
+}
+
+/*
+  Translates every instruction in the chunk. Returns false on an opcode it doesn't know about, so new instructions fall back to run() until they get a template here.
+  "numbers" has a flag for every stack slot that says whether the value there is known to be a number. Constants are, and so is anything
+  -, *, / or unary - leave behind, since they fail on anything else. Checking a known number again would be a waste, so those checks (and the slow paths behind them) never get emitted.
+*/
+static bool compileChunk(Assembler* as, Chunk* chunk, bool* numbers) {
+    // Prologue. Three pushes on top of the return address leave rsp 16-byte aligned, like the C helpers expect.
+    static const uint8_t prologue[] = {
+        0x41, 0x54,       // push r12
+        0x41, 0x55,       // push r13
+        0x41, 0x56,       // push r14
+        0x49, 0x89, 0xFC, // mov r12, rdi
+        0x49, 0x89, 0xF5, // mov r13, rsi
+    };
+    emitBytes(as, prologue, sizeof(prologue));
+    emitLoadImmediate(as, R14, QNAN);
+    int body = emitJump(as, JUMP_ALWAYS);
+
+    // The exits go up front, so every jump to them is backwards and already knows where it's going
+    int errorExit = as->count;
+    emitLoadInt(as, RAX, INTERPRET_RUNTIME_ERROR);
+    int epilogue = as->count;
+    static const uint8_t restore[] = {
+        0x41, 0x5E, // pop r14
+        0x41, 0x5D, // pop r13
+        0x41, 0x5C, // pop r12
+        0xC3,       // ret
+    };
+    emitBytes(as, restore, sizeof(restore));
+    patchJump(as, body);
+
+    Value* constants = chunk->constants.values;
+    int depth = 0; // How many values are on the stack before the current instruction
+    int offset = 0;
+    while (offset < chunk->count) {
+        uint8_t* code = &chunk->code[offset];
+        int top = depth - 1;
+        switch (code[0]) {
+            case OP_CONSTANT:
+                emitPushValue(as, numbers, constants[code[1]], depth++);
+                offset += 2;
+                break;
+            case OP_CONSTANT_LONG:
+                emitPushValue(as, numbers, constants[code[1] | (code[2] << 8) | (code[3] << 16)], depth++);
+                offset += 4;
+                break;
+            case OP_NIL:   emitPushValue(as, numbers, NIL_VAL, depth++); offset++; break;
+            case OP_TRUE:  emitPushValue(as, numbers, TRUE_VAL, depth++); offset++; break;
+            case OP_FALSE: emitPushValue(as, numbers, FALSE_VAL, depth++); offset++; break;
+            // The quickened instructions get the same code as their generic ones. The templates do their own type checks.
+            case OP_EQUAL:
+            case OP_EQUAL_NUM:     emitEquality(as, numbers, false, top - 1); depth--; offset++; break;
+            case OP_NOT_EQUAL:
+            case OP_NOT_EQUAL_NUM: emitEquality(as, numbers, true, top - 1); depth--; offset++; break;
+            case OP_GREATER:       emitComparison(as, numbers, false, false, top - 1, offset + 1, errorExit); depth--; offset++; break;
+            case OP_LESS:          emitComparison(as, numbers, true, false, top - 1, offset + 1, errorExit); depth--; offset++; break;
+            case OP_GREATER_EQUAL: emitComparison(as, numbers, true, true, top - 1, offset + 1, errorExit); depth--; offset++; break;  // !(a < b)
+            case OP_LESS_EQUAL:    emitComparison(as, numbers, false, true, top - 1, offset + 1, errorExit); depth--; offset++; break; // !(a > b)
+            case OP_ADD:
+            case OP_ADD_NUM:
+            case OP_ADD_STR:  emitArithmetic(as, numbers, SSE_ADD, top - 1, offset + 1, errorExit); depth--; offset++; break;
+            case OP_SUBTRACT: emitArithmetic(as, numbers, SSE_SUB, top - 1, offset + 1, errorExit); depth--; offset++; break;
+            case OP_MULTIPLY: emitArithmetic(as, numbers, SSE_MUL, top - 1, offset + 1, errorExit); depth--; offset++; break;
+            case OP_DIVIDE:   emitArithmetic(as, numbers, SSE_DIV, top - 1, offset + 1, errorExit); depth--; offset++; break;
+            case OP_ADD_CONSTANT:
+            case OP_ADD_CONSTANT_NUM:      emitConstantArithmetic(as, numbers, SSE_ADD, constants[code[1]], top, offset + 2, errorExit); offset += 2; break;
+            case OP_SUBTRACT_CONSTANT:
+            case OP_SUBTRACT_CONSTANT_NUM: emitConstantArithmetic(as, numbers, SSE_SUB, constants[code[1]], top, offset + 2, errorExit); offset += 2; break;
+            case OP_MULTIPLY_CONSTANT:
+            case OP_MULTIPLY_CONSTANT_NUM: emitConstantArithmetic(as, numbers, SSE_MUL, constants[code[1]], top, offset + 2, errorExit); offset += 2; break;
+            case OP_DIVIDE_CONSTANT:
+            case OP_DIVIDE_CONSTANT_NUM:   emitConstantArithmetic(as, numbers, SSE_DIV, constants[code[1]], top, offset + 2, errorExit); offset += 2; break;
+            case OP_NOT: {
+                // Only nil and false are falsey
+                emitLoadSlot(as, RAX, top);
+                emitLoadImmediate(as, RCX, NIL_VAL);
+                emitRegisterOp(as, OPCODE_CMP, RAX, RCX);
+                static const uint8_t setDl[] = { 0x0F, 0x94, 0xC2 }; // sete dl
+                emitBytes(as, setDl, sizeof(setDl));
+                emitLoadImmediate(as, RCX, FALSE_VAL);
+                emitRegisterOp(as, OPCODE_CMP, RAX, RCX);
+                static const uint8_t setAl[] = {
+                    0x0F, 0x94, 0xC0, // sete al
+                    0x08, 0xD0,       // or al, dl
+                };
+                emitBytes(as, setAl, sizeof(setAl));
+                emitBoolFromAl(as, false, top);
+                numbers[top] = false;
+                offset++;
+                break;
+            }
+            case OP_NEGATE: {
+                int fails = emitNumberCheck(as, numbers, top);
+                emitLoadSlot(as, RAX, top);
+                static const uint8_t flipSign[] = { 0x48, 0x0F, 0xBA, 0xF8, 0x3F }; // btc rax, 63
+                emitBytes(as, flipSign, sizeof(flipSign));
+                emitStoreSlot(as, top, RAX);
+                if (fails >= 0) {
+                    int done = emitJump(as, JUMP_ALWAYS);
+                    patchJump(as, fails);
+                    emitError(as, offset + 1, "Operand must be a number.", errorExit);
+                    patchJump(as, done);
+                }
+                numbers[top] = true;
+                offset++;
+                break;
+            }
+            case OP_CONCAT: {
+                int count = code[1];
+                emitRegisterOp(as, OPCODE_MOV, RDI, R12);
+                emitSlotAddress(as, RSI, depth);
+                emitLoadInt(as, RDX, (uint32_t)count);
+                emitLoadInt(as, RCX, (uint32_t)(offset + 2));
+                emitFallibleCall(as, (JitHelper)jitConcat, errorExit);
+                depth -= count - 1;
+                numbers[depth - 1] = false;
+                offset += 2;
+                break;
+            }
+            case OP_RETURN:
+                emitRegisterOp(as, OPCODE_MOV, RDI, R12);
+                emitSlotAddress(as, RSI, depth);
+                emitCall(as, (JitHelper)jitReturn);
+                emitLoadInt(as, RAX, INTERPRET_OK);
+                emitJumpTo(as, JUMP_ALWAYS, epilogue);
+                return true; // Nothing after the return can run
+            default:
+                return false;
+        }
+
+        // The slot offsets come straight from the depth, so a chunk whose maxStack is wrong (a damaged image, say) would write past the stack
+        if (depth > chunk->maxStack) return false;
+    }
+
+    return false; // Every chunk ends with OP_RETURN, so falling off the end means something's off
+}
+
+bool compileJit(Chunk* chunk, JitCode* jit) {
+    jit->code = NULL;
+    jit->size = 0;
+
+    Assembler as = { NULL, 0, 0 };
+    bool* numbers = (bool*)calloc((size_t)chunk->maxStack + 1, sizeof(bool));
+    if (numbers == NULL) exit(1);
+    bool compiled = compileChunk(&as, chunk, numbers);
+    free(numbers);
+    if (!compiled) {
+        free(as.code);
+        return false;
+    }
+
+    // Written while it's only writable, then flipped to only executable, so the memory is never both at once
+    void* code = mmap(NULL, (size_t)as.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        free(as.code);
+        return false;
+    }
+    memcpy(code, as.code, (size_t)as.count);
+    free(as.code);
+    if (mprotect(code, (size_t)as.count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, (size_t)as.count);
+        return false;
+    }
+
+    jit->code = code;
+    jit->size = (size_t)as.count;
+    return true;
+}
+
+void freeJit(JitCode* jit) {
+    if (jit->code != NULL) munmap(jit->code, jit->size);
+    jit->code = NULL;
+    jit->size = 0;
+}
+
+InterpretResult runJit(VM* vm, JitCode* jit) {
+    JitFunction function;
+    memcpy(&function, &jit->code, sizeof(function)); // ISO C won't cast a data pointer to a function pointer, but POSIX promises the representation is the same
+    return function(vm, vm->stack);
+}
+#endif
@@ -0,0 +1,29 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "chunk.h"
+
+/*
+  The JIT only knows how to write x86-64 machine code, it gets its executable memory from mmap(), and the code it writes
+  pokes at NaN-boxed values directly. Anywhere else, JIT does nothing and every program runs in run().
+  The debug hooks all live in run()'s dispatch, which machine code skips, so turning any of them on turns the JIT off too.
+*/
+#if defined(JIT) && defined(NAN_BOXING) && defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__)) && \
+    !defined(DEBUG_TRACE_EXECUTION) && !defined(DEBUG_PROFILE) && !defined(DEBUG_COUNT_OPCODE_PAIRS)
+#define JIT_ENABLED
+#endif
+
+#ifdef JIT_ENABLED
+// A program gets compiled to machine code the time it's run this many times. Running something once isn't worth compiling it for.
+#define JIT_THRESHOLD 2
+
+typedef struct {
+    void* code; // NULL if the chunk hasn't been compiled (or couldn't be)
+    size_t size;
+} JitCode;
+
+bool compileJit(Chunk* chunk, JitCode* jit); // Returns false if the chunk has an instruction the JIT doesn't support
+void freeJit(JitCode* jit);
+#endif
+
+#endif
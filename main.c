@@ -5,9 +5,11 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "image.h"
+#include "memory.h"
 #include "vm.h"
 
-static void repl() {
+static void repl(VM* vm) {
     char line[1024];
     for (;;) {
         printf("> ");
@@ -17,7 +19,7 @@ static void repl() {
             break;
         }
 
-        interpret(line);
+        interpret(vm, line);
     }
 }
 
@@ -50,26 +52,83 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
+// The functions below return the process's exit code instead of exiting, so main() still gets to print --mem-stats and free the VM when something goes wrong
+
+// Runs a precompiled bytecode image
+static int runImage(VM* vm, const char* path) {
+    Program* program = loadImage(vm, path);
+    if (program == NULL) {
+        fprintf(stderr, "Could not load image \"%s\".\n", path);
+        return 74;
+    }
+
+    InterpretResult result = runProgram(vm, program);
+    freeProgram(vm, program);
+
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
+}
+
+static int runFile(VM* vm, const char* path) {
+    // Images start with a magic number that can't appear in Lox source, so they can be told apart from scripts
+    if (isImageFile(path)) return runImage(vm, path);
+
+    char* source = readFile(path);
+    InterpretResult result = interpret(vm, source);
+    free(source);
+
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
+}
+
+// Compiles a source file and writes it out as a bytecode image
+static int compileFile(VM* vm, const char* path, const char* imagePath) {
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    Program* program = prepare(vm, source);
     free(source);
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (program == NULL) return 65;
+
+    bool written = writeImage(&program->chunk, imagePath);
+    freeProgram(vm, program);
+    if (!written) {
+        fprintf(stderr, "Could not write image \"%s\".\n", imagePath);
+        return 74;
+    }
+    return 0;
 }
 
 int main(int argc, const char *argv[]) {
-    initVM();
+    VM vm;
+    initVM(&vm);
 
+    // --mem-stats can go in front of any of the other forms. The report goes to stderr, so it doesn't mix with the program's output.
+    bool memStats = false;
+    if (argc > 1 && strcmp(argv[1], "--mem-stats") == 0) {
+        memStats = true;
+        argc--;
+        argv++;
+    }
+
+    int status = 0;
     if (argc == 1) {
-        repl();
+        repl(&vm);
     } else if (argc == 2) {
-        runFile(argv[1]);
+        status = runFile(&vm, argv[1]);
+    } else if (argc == 4 && strcmp(argv[1], "--compile") == 0) {
+        status = compileFile(&vm, argv[2], argv[3]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--mem-stats] [path]\n");
+        fprintf(stderr, "       clox [--mem-stats] --compile [path] [image]\n");
     }
 
-    freeVM();
-    return 0;
+    if (memStats) {
+        MemoryStats stats;
+        getMemoryStats(&vm, &stats);
+        printMemoryStats(&stats, stderr);
+    }
+
+    freeVM(&vm);
+    return status;
 }
\ No newline at end of file
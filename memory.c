@@ -1,9 +1,43 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
+#include "compiler.h"
 #include "memory.h"
 #include "vm.h"
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+#define GC_HEAP_GROW_FACTOR 2 // After a collection, the next one happens once the live heap has doubled
+
+void* reallocate(VM* vm, MemoryCategory category, void* pointer, size_t oldSize, size_t newSize) {
+    CategoryStats* stats = &vm->memory[category];
+    vm->bytesAllocated += newSize - oldSize;
+    stats->bytes += newSize - oldSize;
+    if (pointer == NULL && newSize > 0) stats->allocations++;
+    if (pointer != NULL && newSize == 0) stats->frees++;
+
+    if (newSize > oldSize) {
+        vm->totalBytesAllocated += newSize - oldSize;
+#ifdef DEBUG_STRESS_GC
+        collectGarbage(vm);
+#endif
+        if (vm->bytesAllocated > vm->nextGC) {
+            collectGarbage(vm);
+        }
+
+        // After collecting, so garbage that's about to be freed doesn't count towards the peak along with the new block
+        if (vm->bytesAllocated > vm->peakBytes) vm->peakBytes = vm->bytesAllocated;
+        if (stats->bytes > stats->peakBytes) stats->peakBytes = stats->bytes;
+    } else {
+        vm->totalBytesFreed += oldSize - newSize;
+    }
+
+#ifdef POOL_ALLOCATOR
+    return poolReallocate(&vm->pool, pointer, oldSize, newSize);
+#else
     if (newSize == 0) {
         free(pointer);
         return NULL;
@@ -12,24 +46,206 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     void* result = realloc(pointer, newSize);
     if (result == NULL) exit(1);
     return result;
+#endif
+}
+
+void markObject(VM* vm, Obj* object) {
+    if (object == NULL) return;
+    if (object->isMarked) return; // Already visited. Also stops us from looping forever on cycles.
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    object->isMarked = true;
+
+    // Push it onto the gray stack so its references get traced later. This uses the system realloc so growing it can't kick off a collection in the middle of one.
+    if (vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        vm->grayStack = (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
+        if (vm->grayStack == NULL) exit(1);
+    }
+
+    vm->grayStack[vm->grayCount++] = object;
+}
+
+void markValue(VM* vm, Value value) {
+    if (IS_OBJ(value)) markObject(vm, AS_OBJ(value)); // Numbers, bools and nil don't live on the heap
+}
+
+static void markArray(VM* vm, ValueArray* array) {
+    for (int i = 0; i < array->count; i++) {
+        markValue(vm, array->values[i]);
+    }
 }
 
-static void freeObject(Obj* object) {
+// Traces all the references of a gray object, turning it black
+static void blackenObject(VM* vm, Obj* object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    switch (object->type) {
+        case OBJ_STRING:
+            break; // Strings don't reference anything
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markObject(vm, rope->left);
+            markObject(vm, rope->right);
+            markObject(vm, (Obj*)rope->flat);
+            break;
+        }
+    }
+}
+
+static void freeObject(VM* vm, Obj* object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
     switch(object->type) {
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1); // The raw string was allocated on the heap too, so we must also free that.
-            FREE(ObjString, object);
+            reallocate(vm, MEM_STRINGS, object, STRING_SIZE(string->length), 0); // The characters are part of the same allocation, so this frees them too
             break;
         }
+        case OBJ_ROPE:
+            FREE(vm, MEM_ROPES, ObjRope, object);
+            break;
     }
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
+// Roots are everything the VM can reach directly without going through another object
+static void markRoots(VM* vm) {
+    // Values on the stack
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        markValue(vm, *slot);
+    }
+
+    // Constants of every prepared program (this includes the one being run)
+    for (Program* program = vm->programs; program != NULL; program = program->next) {
+        markArray(vm, &program->chunk.constants);
+    }
+
+    // Constants of the chunk currently being compiled
+    markCompilerRoots(vm);
+}
+
+static void traceReferences(VM* vm) {
+    while (vm->grayCount > 0) {
+        Obj* object = vm->grayStack[--vm->grayCount];
+        blackenObject(vm, object);
+    }
+}
+
+// Frees every object that wasn't marked, then clears the marks on the survivors for the next cycle
+static void sweep(VM* vm) {
+    Obj* previous = NULL;
+    Obj* object = vm->objects;
+    while (object != NULL) {
+        if (object->isMarked) {
+            object->isMarked = false;
+            previous = object;
+            object = object->next;
+        } else {
+            // Unlink the unreachable object, then free it
+            Obj* unreached = object;
+            object = object->next;
+            if (previous != NULL) {
+                previous->next = object;
+            } else {
+                vm->objects = object;
+            }
+
+            freeObject(vm, unreached);
+        }
+    }
+}
+
+void collectGarbage(VM* vm) {
+    clock_t start = clock();
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm->bytesAllocated;
+#endif
+
+    markRoots(vm);
+    traceReferences(vm);
+    tableRemoveWhite(&vm->strings); // The intern table is weak, so strings that are only referenced by it get removed before they're freed
+    sweep(vm);
+
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR; // The threshold scales with the live heap, so big heaps don't collect constantly and small heaps don't grow forever
+    vm->gcCount++;
+    vm->gcPauseSeconds += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+void freeObjects(VM* vm) {
+    Obj* object = vm->objects;
     while (object != NULL) {
         Obj* next = object->next;
-        freeObject(object);
+        freeObject(vm, object);
         object = next;
     }
-}
\ No newline at end of file
+
+    free(vm->grayStack);
+}
+
+void getMemoryStats(VM* vm, MemoryStats* stats) {
+    stats->bytes = vm->bytesAllocated;
+    stats->peakBytes = vm->peakBytes;
+    stats->totalBytesAllocated = vm->totalBytesAllocated;
+    stats->totalBytesFreed = vm->totalBytesFreed;
+    stats->gcCount = vm->gcCount;
+    for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+        stats->categories[i] = vm->memory[i];
+    }
+
+    stats->internedStrings = vm->strings.count;
+    stats->internTombstones = vm->strings.tombstones;
+    stats->internCapacity = vm->strings.capacity;
+
+#ifdef POOL_ALLOCATOR
+    stats->poolBytes = (size_t)vm->pool.arenaCount * POOL_ARENA_SIZE;
+#else
+    stats->poolBytes = 0;
+#endif
+}
+
+void printMemoryStats(MemoryStats* stats, FILE* file) {
+    static const char* names[MEM_CATEGORY_COUNT] = {
+        [MEM_CODE]      = "code",
+        [MEM_LINES]     = "lines",
+        [MEM_CONSTANTS] = "constants",
+        [MEM_TABLES]    = "tables",
+        [MEM_STRINGS]   = "strings",
+        [MEM_ROPES]     = "ropes",
+        [MEM_STACK]     = "stack",
+        [MEM_COMPILER]  = "compiler",
+        [MEM_PROGRAMS]  = "programs",
+    };
+
+    fprintf(file, "-- memory --\n");
+    fprintf(file, "live %zu bytes, peak %zu bytes\n", stats->bytes, stats->peakBytes);
+    fprintf(file, "%zu bytes allocated and %zu freed over %d collections\n", stats->totalBytesAllocated, stats->totalBytesFreed, stats->gcCount);
+    fprintf(file, "%-10s %12s %12s %12s %12s\n", "category", "live", "peak", "allocations", "frees");
+    for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+        CategoryStats* category = &stats->categories[i];
+        fprintf(file, "%-10s %12zu %12zu %12zu %12zu\n", names[i], category->bytes, category->peakBytes, category->allocations, category->frees);
+    }
+
+    double load = stats->internCapacity == 0 ? 0 : 100.0 * (stats->internedStrings + stats->internTombstones) / stats->internCapacity;
+    fprintf(file, "intern table: %d strings, %d tombstones, capacity %d (%.1f%% full)\n",
+        stats->internedStrings, stats->internTombstones, stats->internCapacity, load);
+#ifdef POOL_ALLOCATOR
+    fprintf(file, "pool: %zu bytes of arenas\n", stats->poolBytes);
+#endif
+}
@@ -1,25 +1,70 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object.h"
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+// What an allocation is for. Every call to reallocate() says, so the VM can tell where its memory goes (see getMemoryStats()).
+typedef enum {
+    MEM_CODE,      // Bytecode
+    MEM_LINES,     // Line tables
+    MEM_CONSTANTS, // Constant pools
+    MEM_TABLES,    // Hash tables (the intern table)
+    MEM_STRINGS,   // String objects, characters included
+    MEM_ROPES,     // Rope nodes (not the strings they point to)
+    MEM_STACK,     // The value stack
+    MEM_COMPILER,  // The compiler's scratch space, only around while something's being compiled
+    MEM_PROGRAMS,  // Program structs
+    MEM_CATEGORY_COUNT
+} MemoryCategory;
+
+typedef struct {
+    size_t bytes;     // Live right now
+    size_t peakBytes; // The most that were ever live at once
+    size_t allocations; // Blocks handed out (growing a block in place or moving it doesn't count)
+    size_t frees;       // Blocks given back
+} CategoryStats;
+
+// A snapshot of everything a VM knows about its memory
+typedef struct {
+    size_t bytes; // Live right now, all categories together
+    size_t peakBytes;
+    size_t totalBytesAllocated; // Ever, counting every time a block grew
+    size_t totalBytesFreed;
+    int gcCount;
+    CategoryStats categories[MEM_CATEGORY_COUNT];
+
+    // The intern table
+    int internedStrings;
+    int internTombstones;
+    int internCapacity;
+
+    size_t poolBytes; // Taken from the system for the pool's arenas (0 without POOL_ALLOCATOR)
+} MemoryStats;
+
+#define ALLOCATE(vm, category, type, count) \
+    (type*)reallocate(vm, category, NULL, 0, sizeof(type) * (count))
  
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0) // Used instead of free() so the VM can track memory
+#define FREE(vm, category, type, pointer) reallocate(vm, category, pointer, sizeof(type), 0) // Used instead of free() so the VM can track memory
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2) // If capacity is 0, set to 8. Otherwise, double it.
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-    (type*)reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(vm, category, type, pointer, oldCount, newCount) \
+    (type*)reallocate(vm, category, pointer, sizeof(type) * (oldCount), \
         sizeof(type) * newCount)
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, category, type, pointer, oldCount) \
+    reallocate(vm, category, pointer, sizeof(type) * (oldCount), 0)
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void freeObjects();
+void* reallocate(VM* vm, MemoryCategory category, void* pointer, size_t oldSize, size_t newSize);
+void markObject(VM* vm, Obj* object);
+void markValue(VM* vm, Value value);
+void collectGarbage(VM* vm);
+void freeObjects(VM* vm);
+void getMemoryStats(VM* vm, MemoryStats* stats);
+void printMemoryStats(MemoryStats* stats, FILE* file);
 
 #endif
\ No newline at end of file
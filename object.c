@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -7,63 +8,190 @@
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
-
-// Allocates an object on the heap, then initializes type. The size is passed so the caller can add bytes for extra fields needed by specific objects.
-static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+// Allocates an object on the heap, then initializes its header. The size is passed so the caller can add bytes for extra fields needed by specific objects.
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+    Obj* object = (Obj*)reallocate(vm, type == OBJ_STRING ? MEM_STRINGS : MEM_ROPES, NULL, 0, size);
     object->type = type;
-
-    object->next = vm.objects;
-    vm.objects = object;
+    object->isMarked = false;
+    object->next = NULL;
     return object;
 }
 
-// Creates an ObjString on the heap, then intializes its fields (like a constructor!).
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING); // If this is a ObjString constructor, ALLOCATE_OBJ is like the Obj superclass constructor.
-    string->length = length;
+// Puts an object on the VM's object list, which is what makes the GC aware of it (and eventually free it)
+static void trackObject(VM* vm, Obj* object) {
+    object->next = vm->objects;
+    vm->objects = object;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate type %d\n", (void*)object, object->type);
+#endif
+}
+
+// Gives a finished string to the GC and adds it to the intern table (like a constructor!).
+static ObjString* internString(VM* vm, ObjString* string, uint32_t hash) {
     string->hash = hash;
-    tableSet(&vm.strings, string, NIL_VAL); // Intern the string
-    string->chars = chars;
+    trackObject(vm, (Obj*)string);
+
+    push(vm, OBJ_VAL(string)); // Growing the intern table can trigger a collection, so keep the new string on the stack where the GC can see it
+    tableSet(vm, &vm->strings, string, NIL_VAL); // Intern the string
+    pop(vm);
     return string;
 }
 
-static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
-    }
+/*
+  Allocates a string with room for "length" characters right after its header, for the caller to fill in.
+  It isn't on the object list or interned yet, so the caller has to hand it to takeString() once the characters are written.
+*/
+ObjString* makeString(VM* vm, int length) {
+    ObjString* string = (ObjString*)allocateObject(vm, STRING_SIZE(length), OBJ_STRING); // If this is a ObjString constructor, allocateObject is like the Obj superclass constructor.
+    string->length = length;
+    string->hash = 0;
+    string->chars[length] = '\0'; // String terminator character
+    return string;
 }
 
-// Creates a ObjString from a string already allocated onto the heap.
-ObjString* takeString(char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
+// Takes ownership of a string from makeString(), and returns the interned version of it
+ObjString* takeString(VM* vm, ObjString* string) {
+    uint32_t hash = hashString(vm->hashSecret, string->chars, string->length);
 
     // If the same string already exists, return that
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = tableFindString(&vm->strings, string->chars, string->length, hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1); // Free this string
+        reallocate(vm, MEM_STRINGS, string, STRING_SIZE(string->length), 0); // Free this string. The GC never saw it, so we can just drop it.
         return interned;
     }
-    return allocateString(chars, length, hash);
+    return internString(vm, string, hash);
 }
 
 // Copies a string from our compiler's stack to the heap, then makes an ObjString from it.
-ObjString* copyString(const char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
+ObjString* copyString(VM* vm, const char* chars, int length) {
+    uint32_t hash = hashString(vm->hashSecret, chars, length);
 
     // If the same string already exists, return that
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
     if (interned != NULL) return interned;
 
     // Allocate the string
-    char* heapChars = ALLOCATE(char, length + 1); // Allocate a char array of length + 1 on the heap
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0'; // String terminator character, since the parser string is one long, unterminated one
-    return allocateString(heapChars, length, hash);
+    ObjString* string = makeString(vm, length);
+    memcpy(string->chars, chars, length); // The parser string is one long, unterminated one, so makeString() adds the terminator for us
+    return internString(vm, string, hash);
+}
+
+static int stringLength(Obj* object) {
+    if (object->type == OBJ_STRING) return ((ObjString*)object)->length;
+    return ((ObjRope*)object)->length;
+}
+
+// A rope that's already been flattened is just its string, so new ropes point at that instead and the old node can be collected
+static Obj* unwrapRope(Obj* object) {
+    if (object->type == OBJ_ROPE && ((ObjRope*)object)->flat != NULL) return (Obj*)((ObjRope*)object)->flat;
+    return object;
+}
+
+static ObjRope* makeRope(VM* vm, Obj* left, Obj* right) {
+    ObjRope* rope = (ObjRope*)allocateObject(vm, sizeof(ObjRope), OBJ_ROPE);
+    rope->length = stringLength(left) + stringLength(right);
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    trackObject(vm, (Obj*)rope);
+    return rope;
+}
+
+/*
+  Concatenates two strings or ropes. Short results are copied into a new interned string like before, but longer ones become a rope,
+  so a long chain of + is linear instead of copying (and hashing) everything built so far at every step.
+  The caller has to keep both operands reachable, since this can trigger a collection.
+*/
+Obj* concatenateStrings(VM* vm, Obj* a, Obj* b) {
+    a = unwrapRope(a);
+    b = unwrapRope(b);
+    int length = stringLength(a) + stringLength(b);
+    if (length >= ROPE_MIN_LENGTH || a->type == OBJ_ROPE || b->type == OBJ_ROPE) {
+        return (Obj*)makeRope(vm, a, b);
+    }
+
+    ObjString* left = (ObjString*)a;
+    ObjString* right = (ObjString*)b;
+    ObjString* result = makeString(vm, length);
+    memcpy(result->chars, left->chars, left->length);
+    memcpy(result->chars + left->length, right->chars, right->length);
+    return (Obj*)takeString(vm, result);
+}
+
+/*
+  Copies all of a rope's characters into "chars". A chain of n concatenations makes a rope n levels deep, which would blow the C stack if this
+  recursed, so it walks the tree with its own stack. That stack uses the system malloc, so it can't kick off a collection halfway through.
+*/
+static void writeRopeChars(ObjRope* rope, char* chars) {
+    int capacity = 64;
+    int count = 0;
+    Obj** nodes = (Obj**)malloc(sizeof(Obj*) * capacity);
+    if (nodes == NULL) exit(1);
+    nodes[count++] = (Obj*)rope;
+
+    while (count > 0) {
+        Obj* node = unwrapRope(nodes[--count]);
+        if (node->type == OBJ_STRING) {
+            ObjString* string = (ObjString*)node;
+            memcpy(chars, string->chars, string->length);
+            chars += string->length;
+            continue;
+        }
+
+        if (capacity < count + 2) {
+            capacity *= 2;
+            nodes = (Obj**)realloc(nodes, sizeof(Obj*) * capacity);
+            if (nodes == NULL) exit(1);
+        }
+        // Right goes on first, so left comes off first
+        nodes[count++] = ((ObjRope*)node)->right;
+        nodes[count++] = ((ObjRope*)node)->left;
+    }
+
+    free(nodes);
+}
+
+// Copies the characters of a string or rope to "chars"
+static void writeChars(Obj* object, char* chars) {
+    object = unwrapRope(object);
+    if (object->type == OBJ_STRING) {
+        memcpy(chars, ((ObjString*)object)->chars, ((ObjString*)object)->length);
+    } else {
+        writeRopeChars((ObjRope*)object, chars);
+    }
+}
+
+// Joins a whole run of strings and ropes into one interned string, with a single allocation and a single hash. They all have to be reachable.
+ObjString* concatenateAll(VM* vm, Value* values, int count) {
+    int length = 0;
+    for (int i = 0; i < count; i++) length += stringLength(AS_OBJ(values[i]));
+
+    ObjString* result = makeString(vm, length);
+    char* chars = result->chars;
+    for (int i = 0; i < count; i++) {
+        writeChars(AS_OBJ(values[i]), chars);
+        chars += stringLength(AS_OBJ(values[i]));
+    }
+    return takeString(vm, result);
+}
+
+// Copies a rope into one interned string, and returns it. The rope has to be reachable, since this can trigger a collection.
+ObjString* flattenRope(VM* vm, ObjRope* rope) {
+    if (rope->flat != NULL) return rope->flat;
+
+    ObjString* string = makeString(vm, rope->length); // Not tracked yet, so a collection here can't free it
+    writeRopeChars(rope, string->chars);
+    rope->flat = takeString(vm, string);
+    rope->left = NULL;
+    rope->right = NULL;
+    return rope->flat;
+}
+
+// Returns the flattened string if the value is a rope, or the value itself otherwise
+Value flattenValue(VM* vm, Value value) {
+    if (IS_ROPE(value)) return OBJ_VAL(flattenRope(vm, AS_ROPE(value)));
+    return value;
 }
 
 void printObject(Value value) {
@@ -71,5 +199,19 @@ void printObject(Value value) {
         case OBJ_STRING:
             printf("%s", AS_CSTRING(value));
             break;
+        case OBJ_ROPE: {
+            // Printing can happen in the middle of an instruction (the tracer), so this copies into a scratch buffer instead of flattening, which would allocate on the GC heap
+            ObjRope* rope = AS_ROPE(value);
+            if (rope->flat != NULL) {
+                printf("%s", rope->flat->chars);
+                break;
+            }
+            char* chars = (char*)malloc(rope->length);
+            if (chars == NULL) exit(1);
+            writeRopeChars(rope, chars);
+            fwrite(chars, sizeof(char), rope->length, stdout);
+            free(chars);
+            break;
+        }
     }
 }
\ No newline at end of file
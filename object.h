@@ -7,16 +7,24 @@
 #define OBJ_TYPE(value)     (AS_OBJ(value)->type)
 
 #define IS_STRING(value)    isObjType(value, OBJ_STRING) /* Used to check if Objs are strings, for safe casting. */
+#define IS_ROPE(value)      isObjType(value, OBJ_ROPE)
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value)) // Anything Lox code sees as a string
 
 #define AS_STRING(value)    ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)   (((ObjString*)AS_OBJ(value))->chars)
+#define AS_ROPE(value)      ((ObjRope*)AS_OBJ(value))
+
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1) // Size of a string's single allocation: the header, the characters, and a null terminator
+#define ROPE_MIN_LENGTH 64 // Concatenations shorter than this are just copied, since a rope node would cost more than the copy
 
 typedef enum {
     OBJ_STRING,
+    OBJ_ROPE,
 } ObjType;
 
 struct Obj {
     ObjType type;
+    bool isMarked; // Set by the garbage collector when the object is reachable
     struct Obj* next;
 }; // No typedef because it was forward declared in value.h
 
@@ -24,12 +32,30 @@ struct ObjString {
     // Having Obj as the first value allows ObjStrings to be safely casted to an Obj, and vice-versa. This also means that they share behavior and state, almost like inheritance in OOP.
     Obj obj; 
     int length;
-    char* chars; // Stored on heap
     uint32_t hash; // We cache (store it in the string) a string's hash so we don't have to re-calculate the hash everytime we look for a key.
+    char chars[]; // Flexible array member. The characters live right after the header in the same allocation, so there's one malloc per string and no pointer to chase.
 }; // No typedef because it was forward declared in value.h
 
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);
+/*
+  A string built by concatenation, without copying anything yet. It just points at its two halves, which are strings or other ropes.
+  Lox code can't tell a rope from a string. Anything that needs the actual characters as an ObjString (comparing, using it as a table key)
+  calls flattenRope(), which copies the characters once, interns them, and remembers the result.
+*/
+typedef struct {
+    Obj obj;
+    int length;
+    Obj* left;  // Dropped (set to NULL) once the rope is flattened, so the halves can be collected
+    Obj* right;
+    ObjString* flat; // The interned string, once the rope has been flattened
+} ObjRope;
+
+ObjString* makeString(VM* vm, int length);
+ObjString* takeString(VM* vm, ObjString* string);
+ObjString* copyString(VM* vm, const char* chars, int length);
+Obj* concatenateStrings(VM* vm, Obj* a, Obj* b);
+ObjString* concatenateAll(VM* vm, Value* values, int count);
+ObjString* flattenRope(VM* vm, ObjRope* rope);
+Value flattenValue(VM* vm, Value value);
 void printObject(Value value);
 
 // Not put into macro body because "value" is referred to twice.
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#ifdef POOL_ALLOCATOR
+/*
+  A size-class allocator for the small stuff. Almost everything the VM allocates is small and short-lived (string objects, ropes,
+  little arrays), and sending each one through malloc and free pays for locking and bookkeeping we don't need.
+
+  Sizes up to POOL_MAX_SIZE are rounded up to a multiple of POOL_GRANULE, and each of those classes gets its own free list.
+  Allocating pops a block off the list, and freeing pushes it back on, so both are a couple of instructions.
+  When a list is empty, a fresh block gets bumped off the end of the current arena.
+
+  Blocks don't have a header saying how big they are. reallocate() always passes the old size along, so the size class comes from that.
+  Arenas are only given back to the system at freeVM(). Until then, freed blocks get reused by allocations of the same class.
+*/
+
+// The arena's link is at its start, so blocks begin after it, rounded up to keep them aligned
+#define ARENA_HEADER_SIZE ((sizeof(PoolArena) + POOL_GRANULE - 1) / POOL_GRANULE * POOL_GRANULE)
+
+void initPool(Pool* pool) {
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        pool->freeLists[i] = NULL;
+    }
+    pool->arenas = NULL;
+    pool->arenaCount = 0;
+    pool->next = NULL;
+    pool->end = NULL;
+}
+
+void freePool(Pool* pool) {
+    PoolArena* arena = pool->arenas;
+    while (arena != NULL) {
+        PoolArena* next = arena->next;
+        free(arena);
+        arena = next;
+    }
+    initPool(pool);
+}
+
+static bool isSmall(size_t size) {
+    return size <= POOL_MAX_SIZE;
+}
+
+// Which free list a block of "size" bytes (at least 1) belongs to
+static int sizeClass(size_t size) {
+    return (int)((size - 1) / POOL_GRANULE);
+}
+
+static void* checked(void* result) {
+    if (result == NULL) exit(1);
+    return result;
+}
+
+static void* allocateSmall(Pool* pool, int sizeClass) {
+    PoolBlock* block = pool->freeLists[sizeClass];
+    if (block != NULL) {
+        pool->freeLists[sizeClass] = block->next;
+        return block;
+    }
+
+    size_t size = (size_t)(sizeClass + 1) * POOL_GRANULE;
+    if ((size_t)(pool->end - pool->next) < size) {
+        // Whatever's left at the end of the old arena (less than POOL_MAX_SIZE) is just left there
+        PoolArena* arena = (PoolArena*)checked(malloc(POOL_ARENA_SIZE));
+        arena->next = pool->arenas;
+        pool->arenas = arena;
+        pool->arenaCount++;
+        pool->next = (uint8_t*)arena + ARENA_HEADER_SIZE;
+        pool->end = (uint8_t*)arena + POOL_ARENA_SIZE;
+    }
+
+    void* result = pool->next;
+    pool->next += size;
+    return result;
+}
+
+static void freeSmall(Pool* pool, void* pointer, int sizeClass) {
+    PoolBlock* block = (PoolBlock*)pointer;
+    block->next = pool->freeLists[sizeClass];
+    pool->freeLists[sizeClass] = block;
+}
+
+// Same contract as realloc (and free, when newSize is 0), except the caller has to say how big the block was
+void* poolReallocate(Pool* pool, void* pointer, size_t oldSize, size_t newSize) {
+    bool wasSmall = pointer != NULL && isSmall(oldSize);
+
+    if (newSize == 0) {
+        if (wasSmall) {
+            freeSmall(pool, pointer, sizeClass(oldSize));
+        } else {
+            free(pointer);
+        }
+        return NULL;
+    }
+
+    if (pointer == NULL) {
+        return isSmall(newSize) ? allocateSmall(pool, sizeClass(newSize)) : checked(malloc(newSize));
+    }
+
+    if (!wasSmall && !isSmall(newSize)) return checked(realloc(pointer, newSize));
+
+    // Growing or shrinking within the same class doesn't have to move anything, since the block was rounded up to begin with
+    if (wasSmall && isSmall(newSize) && sizeClass(oldSize) == sizeClass(newSize)) return pointer;
+
+    // Moving between the pool and malloc (or between two classes)
+    void* result = isSmall(newSize) ? allocateSmall(pool, sizeClass(newSize)) : checked(malloc(newSize));
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    if (wasSmall) {
+        freeSmall(pool, pointer, sizeClass(oldSize));
+    } else {
+        free(pointer);
+    }
+    return result;
+}
+#endif
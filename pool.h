@@ -0,0 +1,35 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+#include "common.h"
+
+#ifdef POOL_ALLOCATOR
+#define POOL_GRANULE 16 // Size classes are multiples of this, which also keeps every block as aligned as malloc's
+#define POOL_MAX_SIZE 256 // Anything bigger goes straight to malloc
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_ARENA_SIZE (64 * 1024) // Small blocks are carved out of arenas this big
+
+// A free block. The first bytes of the block itself are reused as the link to the next free one in its size class.
+typedef struct PoolBlock {
+    struct PoolBlock* next;
+} PoolBlock;
+
+typedef struct PoolArena {
+    struct PoolArena* next;
+} PoolArena;
+
+// Every VM has its own pool, and a VM only ever runs on one thread, so none of this needs a lock
+typedef struct {
+    PoolBlock* freeLists[POOL_CLASSES]; // Freed blocks, by size class, ready to be handed out again
+    PoolArena* arenas; // Every arena, so freePool() can give them back
+    int arenaCount;
+    uint8_t* next; // Where the next fresh block in the newest arena starts
+    uint8_t* end;
+} Pool;
+
+void initPool(Pool* pool);
+void freePool(Pool* pool);
+void* poolReallocate(Pool* pool, void* pointer, size_t oldSize, size_t newSize);
+#endif
+
+#endif
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+
+#ifdef DEBUG_PROFILE
+#include "debug.h"
+
+// rdtsc is a single instruction, so it barely disturbs what it's measuring. Everywhere else falls back to a nanosecond clock.
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_CLOCK "cycles"
+static uint64_t profileClock() {
+    return __rdtsc();
+}
+#else
+#include <time.h>
+#define PROFILE_CLOCK "ns"
+static uint64_t profileClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+#endif
+
+void initProfiler(Profiler* profiler) {
+    memset(profiler->opcodes, 0, sizeof(profiler->opcodes));
+    profiler->lineCounts = NULL;
+    profiler->lineCapacity = 0;
+    profiler->pendingOpcode = -1;
+    profiler->pendingStart = 0;
+}
+
+static void countLine(Profiler* profiler, int line) {
+    if (line < 0) return;
+    if (line >= profiler->lineCapacity) {
+        // Plain realloc instead of reallocate(), so the profiler doesn't show up in the GC's numbers or trigger a collection mid-instruction
+        int capacity = profiler->lineCapacity < 64 ? 64 : profiler->lineCapacity;
+        while (capacity <= line) capacity *= 2;
+        profiler->lineCounts = realloc(profiler->lineCounts, sizeof(uint64_t) * capacity);
+        if (profiler->lineCounts == NULL) exit(1);
+        memset(profiler->lineCounts + profiler->lineCapacity, 0, sizeof(uint64_t) * (capacity - profiler->lineCapacity));
+        profiler->lineCapacity = capacity;
+    }
+    profiler->lineCounts[line]++;
+}
+
+// Called by run() right before it dispatches the instruction at ip
+void profileInstruction(Profiler* profiler, Chunk* chunk, uint8_t* ip) {
+    uint64_t now = profileClock();
+    if (profiler->pendingOpcode >= 0) profiler->opcodes[profiler->pendingOpcode].time += now - profiler->pendingStart;
+
+    profiler->pendingOpcode = *ip;
+    profiler->opcodes[*ip].count++;
+    countLine(profiler, getLine(chunk, (int)(ip - chunk->code)));
+
+    // Taken again after the bookkeeping, so the profiler's own overhead isn't charged to the next instruction
+    profiler->pendingStart = profileClock();
+}
+
+// Called when run() returns, so the last instruction gets its time too
+void profileStop(Profiler* profiler) {
+    if (profiler->pendingOpcode >= 0) profiler->opcodes[profiler->pendingOpcode].time += profileClock() - profiler->pendingStart;
+    profiler->pendingOpcode = -1;
+}
+
+// Returns the hottest lines in order, and how many there are (at most PROFILE_TOP_LINES)
+static int hottestLines(Profiler* profiler, int* lines) {
+    uint64_t* lineCounts = profiler->lineCounts;
+    int found = 0;
+    for (int line = 0; line < profiler->lineCapacity; line++) {
+        if (lineCounts[line] == 0) continue;
+
+        // Insertion into a short sorted list. Ties keep the lower line first.
+        int slot = found < PROFILE_TOP_LINES ? found++ : PROFILE_TOP_LINES;
+        while (slot > 0 && lineCounts[lines[slot - 1]] < lineCounts[line]) {
+            if (slot < PROFILE_TOP_LINES) lines[slot] = lines[slot - 1];
+            slot--;
+        }
+        if (slot < PROFILE_TOP_LINES) lines[slot] = line;
+    }
+    return found;
+}
+
+static void writeJson(Profiler* profiler, FILE* file, int* lines, int lineCount) {
+    fprintf(file, "{\n  \"clock\": \"%s\",\n  \"opcodes\": [", PROFILE_CLOCK);
+    bool first = true;
+    for (int opcode = 0; opcode <= UINT8_MAX; opcode++) {
+        OpcodeProfile* profile = &profiler->opcodes[opcode];
+        if (profile->count == 0) continue;
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"count\": %llu, \"time\": %llu, \"average\": %.2f}",
+            first ? "" : ",", opcodeName(opcode), (unsigned long long)profile->count,
+            (unsigned long long)profile->time, (double)profile->time / profile->count);
+        first = false;
+    }
+    fprintf(file, "\n  ],\n  \"lines\": [");
+    for (int i = 0; i < lineCount; i++) {
+        fprintf(file, "%s\n    {\"line\": %d, \"count\": %llu}", i == 0 ? "" : ",", lines[i], (unsigned long long)profiler->lineCounts[lines[i]]);
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+// One table for both sections: the kind column says whether a row is an opcode or a line
+static void writeCsv(Profiler* profiler, FILE* file, int* lines, int lineCount) {
+    fprintf(file, "kind,name,count,time,average\n");
+    for (int opcode = 0; opcode <= UINT8_MAX; opcode++) {
+        OpcodeProfile* profile = &profiler->opcodes[opcode];
+        if (profile->count == 0) continue;
+        fprintf(file, "opcode,%s,%llu,%llu,%.2f\n", opcodeName(opcode), (unsigned long long)profile->count,
+            (unsigned long long)profile->time, (double)profile->time / profile->count);
+    }
+    for (int i = 0; i < lineCount; i++) {
+        fprintf(file, "line,%d,%llu,,\n", lines[i], (unsigned long long)profiler->lineCounts[lines[i]]);
+    }
+}
+
+// Writes the report and resets the counters. Called from freeVM().
+void writeProfile(Profiler* profiler) {
+    profileStop(profiler);
+
+    const char* path = getenv("CLOX_PROFILE");
+    if (path == NULL || path[0] == '\0') path = PROFILE_OUTPUT;
+
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write profile to \"%s\".\n", path);
+    } else {
+        int lines[PROFILE_TOP_LINES];
+        int lineCount = hottestLines(profiler, lines);
+
+        size_t length = strlen(path);
+        if (length >= 4 && strcmp(path + length - 4, ".csv") == 0) {
+            writeCsv(profiler, file, lines, lineCount);
+        } else {
+            writeJson(profiler, file, lines, lineCount);
+        }
+        fclose(file);
+    }
+
+    free(profiler->lineCounts);
+    initProfiler(profiler);
+}
+#endif
@@ -0,0 +1,35 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "chunk.h"
+
+#ifdef DEBUG_PROFILE
+// Where the report goes at freeVM(). The CLOX_PROFILE environment variable overrides it. A path ending in .csv gets CSV, anything else gets JSON.
+#define PROFILE_OUTPUT "clox-profile.json"
+#define PROFILE_TOP_LINES 20 // How many of the hottest source lines make it into the report
+
+typedef struct {
+    uint64_t count;
+    uint64_t time; // In PROFILE_CLOCK units (see profile.c)
+} OpcodeProfile;
+
+// Everything the profiler has counted so far. Every VM has its own.
+typedef struct {
+    OpcodeProfile opcodes[UINT8_MAX + 1];
+
+    // Execution counts indexed by source line. Lines are small and dense, so a plain array beats a hash table here.
+    uint64_t* lineCounts;
+    int lineCapacity;
+
+    // The instruction that's running right now. It gets charged for the time up to the next call to profileInstruction() or profileStop().
+    int pendingOpcode;
+    uint64_t pendingStart;
+} Profiler;
+
+void initProfiler(Profiler* profiler);
+void profileInstruction(Profiler* profiler, Chunk* chunk, uint8_t* ip);
+void profileStop(Profiler* profiler);
+void writeProfile(Profiler* profiler);
+#endif
+
+#endif
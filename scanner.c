@@ -4,101 +4,264 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-    const char* start;
-    const char* current;
-    int line;
-} Scanner;
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SCANNER_SSE2
+#endif
+
+/*
+  Whitespace, comments, strings and identifiers are runs of "boring" characters, and big scripts are mostly made of them.
+  With SSE2, the scanner checks 16 of them at a time: it compares the whole block against the characters it cares about,
+  gets a 16 bit mask back (bit i is set if character i matched), and jumps straight to the first one that ends the run.
+  Newlines in the skipped part are counted off the same masks. Blocks are only read while 16 whole bytes are left before the
+  end of the source, so nothing past the '\0' is ever touched. Near the end (or without SSE2), it goes one character at a time.
+*/
+#define BLOCK_SIZE 16
+
+void initScanner(Scanner* scanner, const char* source) {
+    scanner->start = source;
+    scanner->current = source;
+    scanner->end = source + strlen(source);
+    scanner->line = 1;
+}
 
-Scanner scanner;
+// What kind of character each byte is, so checking one is a single load instead of a chain of range compares
+#define CHAR_ALPHA 0x01 // Letters, and '_' since identifiers have those too
+#define CHAR_DIGIT 0x02
+#define CHAR_BLANK 0x04 // Whitespace and newlines
+
+#define A CHAR_ALPHA
+#define D CHAR_DIGIT
+#define B CHAR_BLANK
+static const uint8_t charClasses[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, B, B, 0, 0, B, 0, 0, // '\t' '\n' '\r'
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    B, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // ' '
+    D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0, // '0' - '9'
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, // 'A' - 'O'
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, A, // 'P' - 'Z', '_'
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, // 'a' - 'o'
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, 0, // 'p' - 'z'
+    // Everything from 0x80 up is 0
+};
+#undef A
+#undef D
+#undef B
+
+static inline bool isAlpha(char c) {
+    return (charClasses[(uint8_t)c] & CHAR_ALPHA) != 0;
+}
 
-void initScanner(const char* source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+static inline bool isDigit(char c) {
+    return (charClasses[(uint8_t)c] & CHAR_DIGIT) != 0;
 }
 
-static bool isAlpha(char c) {
-    return (c >= 'a' && c <= 'z') ||
-           (c >= 'A' && c <= 'Z') ||
-            c == '_'; // Identifiers have these things too
+// Letters, digits and underscores, so anything after the first character of an identifier
+static inline bool isIdentifierChar(char c) {
+    return (charClasses[(uint8_t)c] & (CHAR_ALPHA | CHAR_DIGIT)) != 0;
 }
 
-static bool isDigit(char c) {
-    return c >= '0' && c <= '9';
+static inline bool isBlank(char c) {
+    return (charClasses[(uint8_t)c] & CHAR_BLANK) != 0;
 }
 
 // Ts jlox reference so heat ❤️‍🩹❤️‍🩹
-static bool isAtEnd() {
+static bool isAtEnd(Scanner* scanner) {
     // Quick review! '\0', or the null/string terminator character, always ends a string!
-    return *scanner.current == '\0';
+    return *scanner->current == '\0';
 }
 
 // Returns the current character, and then goes to the next one (consumes current one).
-static char advance() {
-    scanner.current++;
-    return scanner.current[-1];
+static char advance(Scanner* scanner) {
+    scanner->current++;
+    return scanner->current[-1];
 }
 
 // Returns the current character without consuming it
-static char peek() {
-    return *scanner.current;
+static char peek(Scanner* scanner) {
+    return *scanner->current;
 }
 
 // Returns the next character without consuming the current one
-static char peekNext() {
-    if (isAtEnd()) return '\0';
-    return scanner.current[1]; // One character past the current one (its a pointer)
+static char peekNext(Scanner* scanner) {
+    if (isAtEnd(scanner)) return '\0';
+    return scanner->current[1]; // One character past the current one (its a pointer)
 }
 
 // Check if the next character is the expected character (param). If so, consume the current character and return 'true'.
-static bool match(char expected) {
-    if (isAtEnd()) return false;
-    if (*scanner.current != expected) return false;
-    scanner.current++;
+static bool match(Scanner* scanner, char expected) {
+    if (isAtEnd(scanner)) return false;
+    if (*scanner->current != expected) return false;
+    scanner->current++;
     return true;
 }
 
+#ifdef SCANNER_SSE2
+typedef uint32_t BitMask; // Bit i is set if character i of a block matched
+
+static inline int trailingZeros(BitMask mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int count = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+static inline int popCount(BitMask mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcount(mask);
+#else
+    int count = 0;
+    for (; mask != 0; mask &= mask - 1) count++;
+    return count;
+#endif
+}
+
+static inline BitMask matchByte(__m128i block, char c) {
+    return (BitMask)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+// Matches every character from low to high. Compares are signed, but the ranges we check are all ASCII, and everything from 0x80 up is negative and lands outside them.
+static inline BitMask matchRange(__m128i block, char low, char high) {
+    __m128i aboveLow = _mm_cmpgt_epi8(block, _mm_set1_epi8((char)(low - 1)));
+    __m128i belowHigh = _mm_cmplt_epi8(block, _mm_set1_epi8((char)(high + 1)));
+    return (BitMask)_mm_movemask_epi8(_mm_and_si128(aboveLow, belowHigh));
+}
+
+static inline bool hasBlock(Scanner* scanner) {
+    return scanner->end - scanner->current >= BLOCK_SIZE;
+}
+
+static inline __m128i loadBlock(Scanner* scanner) {
+    return _mm_loadu_si128((const __m128i*)scanner->current);
+}
+
+// Moves past the first "length" characters of a block, counting the newlines in them
+static inline void skipInBlock(Scanner* scanner, BitMask newlines, int length) {
+    scanner->line += popCount(newlines & ((1u << length) - 1));
+    scanner->current += length;
+}
+#endif
+
+// Skips a run of spaces, tabs, carriage returns and newlines
+static void skipBlanks(Scanner* scanner) {
+    // Most runs are a single space between two tokens, which isn't worth loading a whole block for
+    if (peek(scanner) == '\n') scanner->line++;
+    advance(scanner);
+    if (!isBlank(peek(scanner))) return;
+
+#ifdef SCANNER_SSE2
+    while (hasBlock(scanner)) {
+        __m128i block = loadBlock(scanner);
+        BitMask newlines = matchByte(block, '\n');
+        BitMask blanks = newlines | matchByte(block, ' ') | matchByte(block, '\t') | matchByte(block, '\r');
+        if (blanks != 0xFFFF) {
+            skipInBlock(scanner, newlines, trailingZeros(~blanks));
+            return;
+        }
+        skipInBlock(scanner, newlines, BLOCK_SIZE);
+    }
+#endif
+    while (isBlank(peek(scanner))) {
+        if (peek(scanner) == '\n') scanner->line++;
+        advance(scanner);
+    }
+}
+
+// Skips to the newline at the end of a comment (or the end of the source). The newline itself is left for skipBlanks() to count.
+static void skipComment(Scanner* scanner) {
+#ifdef SCANNER_SSE2
+    while (hasBlock(scanner)) {
+        BitMask newlines = matchByte(loadBlock(scanner), '\n');
+        if (newlines != 0) {
+            scanner->current += trailingZeros(newlines);
+            return;
+        }
+        scanner->current += BLOCK_SIZE;
+    }
+#endif
+    while (peek(scanner) != '\n' && !isAtEnd(scanner)) advance(scanner);
+}
+
+// Skips to the closing quote of a string (or the end of the source), counting the newlines on the way. Lox supports multi-line strings.
+static void skipStringBody(Scanner* scanner) {
+#ifdef SCANNER_SSE2
+    while (hasBlock(scanner)) {
+        __m128i block = loadBlock(scanner);
+        BitMask newlines = matchByte(block, '\n');
+        BitMask quotes = matchByte(block, '"');
+        if (quotes != 0) {
+            skipInBlock(scanner, newlines, trailingZeros(quotes));
+            return;
+        }
+        skipInBlock(scanner, newlines, BLOCK_SIZE);
+    }
+#endif
+    while (peek(scanner) != '"' && !isAtEnd(scanner)) { // Goes until the end of the string... or file
+        if (peek(scanner) == '\n') scanner->line++; // Watching out for newlines
+        advance(scanner);
+    }
+}
+
+// Skips the rest of an identifier (letters, digits and underscores)
+static void skipIdentifierBody(Scanner* scanner) {
+#ifdef SCANNER_SSE2
+    while (hasBlock(scanner)) {
+        __m128i block = loadBlock(scanner);
+        // Setting bit 5 turns 'A'-'Z' into 'a'-'z', and doesn't turn anything else into a letter
+        BitMask letters = matchRange(_mm_or_si128(block, _mm_set1_epi8(0x20)), 'a', 'z');
+        BitMask identifier = letters | matchRange(block, '0', '9') | matchByte(block, '_');
+        if (identifier != 0xFFFF) {
+            scanner->current += trailingZeros(~identifier);
+            return;
+        }
+        scanner->current += BLOCK_SIZE;
+    }
+#endif
+    while (isIdentifierChar(peek(scanner))) advance(scanner);
+}
+
 // Makes a token
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner* scanner, TokenType type) {
     Token token;
     token.type = type;
-    token.start = scanner.start; // Sets start of token to start of scanner's current lexeme
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start; // Sets start of token to start of scanner's current lexeme
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
 // Makes an error token
-static Token errorToken(const char* message) {
+static Token errorToken(Scanner* scanner, const char* message) {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
-static void skipWhitespace() {
-    for (;;) { // To skip more than one character of whitespace
-        char c = peek();
+static void skipWhitespace(Scanner* scanner) {
+    for (;;) { // Whitespace and comments can take turns, so keep going until neither is next
+        char c = peek(scanner);
         switch(c) {
-            // Goes to next character if whitespace
+            // Skips the whole run of whitespace and newlines
             case ' ':
             case '\r':
             case '\t':
-                advance();
-                break; // 'break' is used to continue the loop to advance past ALL whitespace
-            // Goes to next line and character if newline
-            case '\n': 
-                scanner.line++;
-                advance();
-                break;
+            case '\n':
+                skipBlanks(scanner);
+                break; // 'break' is used to continue the loop to check for a comment after the whitespace
             // If not whitespace/newline, then return (and exit the loop)
             case '/':
-                if (peekNext() == '/') { // If it isn't a double slash, we don't want to mark it as whitespace
+                if (peekNext(scanner) == '/') { // If it isn't a double slash, we don't want to mark it as whitespace
                     // A comment goes until the end of the line.
-                    while (peek() != '\n' && !isAtEnd()) advance;
+                    skipComment(scanner);
                 } else {
                     return;
                 }
@@ -109,126 +272,124 @@ static void skipWhitespace() {
     }
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-    // Checks if the current lexeme is the same length as the keyword, and if their values are equal
-    if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0) {
-        return type;
-    }
+/*
+  Keywords are looked up in a perfect hash table: every keyword lands in its own slot, so an identifier only ever has to be compared
+  against the one keyword in its slot. The hash mixes the first character, the last one and the length, which was the cheapest mix
+  that splits all 16 keywords up in 32 slots. It's a macro so the table below can be filled in at compile time, and if a new keyword
+  ever collides with an old one, the compiler warns about initializing the same slot twice (-Woverride-init, which is in -Wextra).
+*/
+#define KEYWORD_SLOTS 32
+#define KEYWORD_HASH(first, last, length) (((uint8_t)(first) + (uint8_t)(last) * 5 + (length)) & (KEYWORD_SLOTS - 1))
 
+typedef struct {
+    const char* name;
+    int length; // 0 for empty slots, which no identifier can match
+    TokenType type;
+} Keyword;
+
+// C won't index into a string literal in a constant expression, so the first and last characters are spelled out
+#define KEYWORD(name, first, last, type) [KEYWORD_HASH(first, last, sizeof(name) - 1)] = { name, sizeof(name) - 1, type }
+static const Keyword keywords[KEYWORD_SLOTS] = {
+    KEYWORD("and", 'a', 'd', TOKEN_AND),
+    KEYWORD("class", 'c', 's', TOKEN_CLASS),
+    KEYWORD("else", 'e', 'e', TOKEN_ELSE),
+    KEYWORD("false", 'f', 'e', TOKEN_FALSE),
+    KEYWORD("for", 'f', 'r', TOKEN_FOR),
+    KEYWORD("fun", 'f', 'n', TOKEN_FUN),
+    KEYWORD("if", 'i', 'f', TOKEN_IF),
+    KEYWORD("nil", 'n', 'l', TOKEN_NIL),
+    KEYWORD("or", 'o', 'r', TOKEN_OR),
+    KEYWORD("print", 'p', 't', TOKEN_PRINT),
+    KEYWORD("return", 'r', 'n', TOKEN_RETURN),
+    KEYWORD("super", 's', 'r', TOKEN_SUPER),
+    KEYWORD("this", 't', 's', TOKEN_THIS),
+    KEYWORD("true", 't', 'e', TOKEN_TRUE),
+    KEYWORD("var", 'v', 'r', TOKEN_VAR),
+    KEYWORD("while", 'w', 'e', TOKEN_WHILE),
+};
+#undef KEYWORD
+
+static TokenType identifierType(Scanner* scanner) {
+    int length = (int)(scanner->current - scanner->start);
+    const Keyword* keyword = &keywords[KEYWORD_HASH(scanner->start[0], scanner->current[-1], length)];
+    if (keyword->length == length && memcmp(scanner->start, keyword->name, length) == 0) return keyword->type;
     return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifierType() {
-    switch (scanner.start[0]) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'f': 
-            if (scanner.current - scanner.start > 1) { // Check if there is 2 or more characters
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-                }
-            }
-            break; // Fall to return identifier
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 't': 
-            if (scanner.current - scanner.start > 1) { // Check if there is 2 or more characters
-                switch (scanner.start[1]) {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            }
-            break; // Fall to return identifier
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-    }
-    return TOKEN_IDENTIFIER; 
+static Token identifier(Scanner* scanner) {
+    skipIdentifierBody(scanner);
+    return makeToken(scanner, identifierType(scanner));
 }
 
-static Token identifier() {
-    while (isAlpha(peek()) || isDigit(peek())) advance();
-    return makeToken(identifierType());
-}
-
-static Token number() {
+static Token number(Scanner* scanner) {
     // Consume characters while they are digits
-    while (isDigit(peek())) advance();
+    while (isDigit(peek(scanner))) advance(scanner);
 
     // Look for a decimal part.
-    if (peek() == '.' && isDigit(peekNext())) {
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
         // Consume the ".".
-        advance();
+        advance(scanner);
 
-        while (isDigit(peek())) advance();
+        while (isDigit(peek(scanner))) advance(scanner);
     }
 
-    return makeToken(TOKEN_NUMBER); // We leave converting literals to runtime values for later
+    return makeToken(scanner, TOKEN_NUMBER); // We leave converting literals to runtime values for later
 }
 
-static Token string() {
-    while(peek() != '"' && !isAtEnd()) { // Goes until the end of the string... or file
-        if (peek() == '\n') scanner.line++; // Watching out for newlines. Lox supports multi-line strings.
-        advance();
-    }
+static Token string(Scanner* scanner) {
+    skipStringBody(scanner);
 
     // If we reach the end of the file without the string ending, it's an unterminated string.
-    if (isAtEnd()) return errorToken("Unterminated string");
+    if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string");
 
     // The closing quote.
-    advance();
-    return makeToken(TOKEN_STRING); // We leave converting literals to runtime values for later
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING); // We leave converting literals to runtime values for later
 }
 
 // Scans a single token. We don't want to manage a dynamic array for all the tokens, so we just scan them one at a time.
-Token scanToken() {
-    skipWhitespace();
+Token scanToken(Scanner* scanner) {
+    skipWhitespace(scanner);
 
     // Set the scanner to start at the next new token
-    scanner.start = scanner.current;
+    scanner->start = scanner->current;
 
     // EOF check
-    if (isAtEnd()) return makeToken(TOKEN_EOF); 
+    if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF); 
 
-    char c = advance();
-    if (isAlpha(c)) return identifier();
-    if (isDigit(c)) return number();
+    char c = advance(scanner);
+    if (isAlpha(c)) return identifier(scanner);
+    if (isDigit(c)) return number(scanner);
 
     switch (c) {
         // Single character tokens
-        case '(': return makeToken(TOKEN_LEFT_PAREN);
-        case ')': return makeToken(TOKEN_RIGHT_PAREN); 
-        case '{': return makeToken(TOKEN_LEFT_BRACE);
-        case '}': return makeToken(TOKEN_RIGHT_BRACE);
-        case ';': return makeToken(TOKEN_SEMICOLON);
-        case ',': return makeToken(TOKEN_COMMA);
-        case '.': return makeToken(TOKEN_DOT);
-        case '-': return makeToken(TOKEN_MINUS);
-        case '+': return makeToken(TOKEN_PLUS);
-        case '/': return makeToken(TOKEN_SLASH);
-        case '*': return makeToken(TOKEN_STAR);
+        case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+        case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN); 
+        case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+        case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+        case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+        case ',': return makeToken(scanner, TOKEN_COMMA);
+        case '.': return makeToken(scanner, TOKEN_DOT);
+        case '-': return makeToken(scanner, TOKEN_MINUS);
+        case '+': return makeToken(scanner, TOKEN_PLUS);
+        case '/': return makeToken(scanner, TOKEN_SLASH);
+        case '*': return makeToken(scanner, TOKEN_STAR);
         
         // One or two character tokens
         // If the first character is found, check if the next one is '=', then consume '=' and return corresponding value
         case '!':
-            return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
         case '=':
-            return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
         case '<':
-            return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
         case '>':
-            return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
 
         // Literals
-        case '"': return string();
+        case '"': return string(scanner);
     }
 
     // No valid token, so an error is produced.
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
 }
\ No newline at end of file
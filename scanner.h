@@ -44,7 +44,15 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+// Where the scanner is in the source. Each compile has its own, so two threads can scan at the same time.
+typedef struct {
+    const char* start;   // Start of the lexeme being scanned
+    const char* current; // The character being looked at
+    const char* end;     // The '\0' at the end of the source, so the fast paths know how many bytes they can read at once
+    int line;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+Token scanToken(Scanner* scanner);
 
 #endif
\ No newline at end of file
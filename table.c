@@ -6,42 +6,143 @@
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TABLE_SSE2
+#endif
+
+/*
+  This is a "Swiss table". Next to the entries there's a separate array of control bytes, one per entry:
+    - CTRL_EMPTY means the slot has never been used (probing can stop here)
+    - CTRL_DELETED is a tombstone (probing has to keep going)
+    - Anything else is a full slot, and the byte holds the low 7 bits of the key's hash ("H2")
+  The rest of the hash ("H1") picks where probing starts. Probing looks at a whole group of 16 control bytes at a time,
+  which SSE2 can compare against H2 in a single instruction. We only touch an Entry when its control byte already matches,
+  so most misses never leave the control array.
+*/
+#define TABLE_MAX_LOAD 0.875
+#define GROUP_WIDTH 16
+
+#define CTRL_EMPTY   ((uint8_t)0x80) // 1000 0000
+#define CTRL_DELETED ((uint8_t)0xFE) // 1111 1110. Full slots never have the top bit set, so empty and deleted both do.
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7F))
+
+typedef uint32_t BitMask; // Bit i is set if slot i of a group matched
+
+static inline bool isFull(uint8_t control) {
+    return control < 0x80;
+}
+
+static inline int trailingZeros(BitMask mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int count = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+// Counts the zeros at the top of a 16 bit group mask
+static inline int leadingZeros(BitMask mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clz(mask << 16);
+#else
+    int count = 0;
+    for (BitMask bit = 1u << (GROUP_WIDTH - 1); bit != 0 && (mask & bit) == 0; bit >>= 1) count++;
+    return count;
+#endif
+}
+
+// Finds the slots in the group starting at "group" whose control byte is "byte"
+static inline BitMask matchByte(const uint8_t* group, uint8_t byte) {
+#ifdef TABLE_SSE2
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (BitMask)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+#else
+    BitMask mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (group[i] == byte) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Finds the empty or deleted slots in a group (the ones with the top bit set)
+static inline BitMask matchEmptyOrDeleted(const uint8_t* group) {
+#ifdef TABLE_SSE2
+    return (BitMask)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    BitMask mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (!isFull(group[i])) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+/*
+  The control array has GROUP_WIDTH extra bytes at the end that mirror the first GROUP_WIDTH bytes.
+  That way a group can start at any slot and still be loaded with one read, even if it wraps around the end.
+*/
+static void setControl(Table* table, int index, uint8_t control) {
+    table->control[index] = control;
+    if (index < GROUP_WIDTH) table->control[table->capacity + index] = control;
+}
 
 void initTable(Table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
-void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity); // FREE_ARRAY already checks for NULL arrays
+void freeTable(VM* vm, Table* table) {
+    if (table->capacity > 0) {
+        FREE_ARRAY(vm, MEM_TABLES, uint8_t, table->control, table->capacity + GROUP_WIDTH);
+        FREE_ARRAY(vm, MEM_TABLES, Entry, table->entries, table->capacity);
+    }
     initTable(table); // Set everything to 0/NULL
 }
 
-// Finds an entry or a spot for one
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash % capacity; // Map entry to an index using key hash modulus capacity (basically folds the range on itself so it can fit in the array)
-    Entry* tombstone = NULL;
+/*
+  Finds the slot holding a key, or returns -1.
+  Groups are probed with triangular steps (16, 32, 48...), which is guaranteed to visit every group when the capacity is a power of two.
+  A group with an empty slot in it ends the search, since the key would've been put there if it had made it that far.
+*/
+static int findSlot(Table* table, ObjString* key) {
+    int mask = table->capacity - 1; // capacity is a power of two, so this replaces "% capacity"
+    uint8_t h2 = H2(key->hash);
+    int position = H1(key->hash) & mask;
 
-    // Probing loop. Load factor prevents infinite loop (since there will always be space, the return statement will always be accessible)
-    for (;;) {
-        Entry* entry = &entries[index];
+    for (int step = GROUP_WIDTH;; step += GROUP_WIDTH) {
+        const uint8_t* group = &table->control[position];
 
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone, so we return its bucket so it can still be used as space for a new entry
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // We found the key, so we return the entry
-            return entry;
+        for (BitMask match = matchByte(group, h2); match != 0; match &= match - 1) { // "match &= match - 1" clears the lowest set bit
+            int index = (position + trailingZeros(match)) & mask;
+            if (table->entries[index].key == key) return index;
         }
 
-        index = (index + 1) % capacity; // "Probe" (loop to) the next bucket if there is a collision (different key currently in this bucket). The "% capacity" wraps us to the beginning if we go past the end of the array.
+        if (matchByte(group, CTRL_EMPTY) != 0) return -1;
+        position = (position + step) & mask;
+    }
+}
+
+// Finds the first empty or deleted slot along a hash's probe sequence. The load factor makes sure there always is one.
+static int findInsertSlot(Table* table, uint32_t hash) {
+    int mask = table->capacity - 1;
+    int position = H1(hash) & mask;
+
+    for (int step = GROUP_WIDTH;; step += GROUP_WIDTH) {
+        BitMask match = matchEmptyOrDeleted(&table->control[position]);
+        if (match != 0) return (position + trailingZeros(match)) & mask;
+        position = (position + step) & mask;
     }
 }
 
@@ -50,65 +151,72 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false; // Return false if there are no entries
 
     // Find the entry
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false; // Return false if the bucket is empty
+    int index = findSlot(table, key);
+    if (index < 0) return false;
 
     // Copy the entry's value to the output parameter
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true; // Return true for succesful operation
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-    // Allocate a new array of buckets/entries
-    Entry* entries = ALLOCATE(Entry, capacity);
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
+    // Allocate the new arrays, with every slot empty
+    uint8_t* control = ALLOCATE(vm, MEM_TABLES, uint8_t, capacity + GROUP_WIDTH);
+    Entry* entries = ALLOCATE(vm, MEM_TABLES, Entry, capacity);
+    memset(control, CTRL_EMPTY, capacity + GROUP_WIDTH);
 
-    // Initialize every entry
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
+    Table resized;
+    resized.count = 0;
+    resized.tombstones = 0; // Rehashing throws every tombstone away
+    resized.capacity = capacity;
+    resized.control = control;
+    resized.entries = entries;
 
-    // Clear count because of tombstones (every entry will be in adjacent buckets anyway since we're re-probing)
-    table->count = 0;
-    // Check old entry array (if table is being resized)
+    // Re-insert the old entries. Keys are unique, so we don't need to look for them first.
     for (int i = 0; i < table->capacity; i++) {
-        // Entry at this index
-        Entry* entry = &table->entries[i];
-
-        // If there was no entry or a tombstone here before, continue
-        if (entry->key == NULL) continue;
+        if (!isFull(table->control[i])) continue;
 
-        // Find spot in new array for this entry using new capacity (this is why it takes an Entry* as an argument as opposed to a table)
-        Entry* dest = findEntry(entries, capacity, entry->key); // Stores the spot in memory (its a pointer to the new array)
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++; // Add to entry count
+        Entry* entry = &table->entries[i];
+        int index = findInsertSlot(&resized, entry->key->hash);
+        setControl(&resized, index, table->control[i]); // Control byte is just H2, so it can be copied as is
+        resized.entries[index] = *entry;
+        resized.count++;
     }
 
-    // Free old array
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-
-    // Store new array data in hash table struct
-    table->entries = entries;
-    table->capacity = capacity;
+    // Free old arrays
+    freeTable(vm, table);
+    *table = resized;
 }
 
 // Adds a key-value pair to the table
-bool tableSet(Table* table, ObjString* key, Value value) {
-    // Grow when array is 75% full
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) { 
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
+    // Replace the value if the key is already here
+    if (table->count > 0) {
+        int index = findSlot(table, key);
+        if (index >= 0) {
+            table->entries[index].value = value;
+            return false;
+        }
+    }
+
+    // Tombstones make probing longer just like entries do, so they count towards the load
+    if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD) {
+        int capacity = table->capacity;
+        // If most of the load is tombstones, rehashing at the same size is enough to clean them out
+        if (table->count + 1 > capacity * TABLE_MAX_LOAD / 2) {
+            capacity = capacity < GROUP_WIDTH ? GROUP_WIDTH : capacity * 2;
+        }
+        adjustCapacity(vm, table, capacity);
     }
-    // Find spot for entry or find existing entry to replace
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL; // If it is NULL, that means the bucket is empty, meaning it is a new key.
-    if (isNewKey && IS_NIL(entry->value)) table->count++; // Add to count if it is a new key AND if its not a tombstone (tombstones count as entries)
 
     // Add the entry
-    entry->key = key;
-    entry->value = value;
-    return isNewKey; // Return if the key is new or not
+    int index = findInsertSlot(table, key->hash);
+    if (table->control[index] == CTRL_DELETED) table->tombstones--; // Reusing a tombstone
+    setControl(table, index, H2(key->hash));
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->count++;
+    return true; // The key is new
 }
 
 // Deletes an entry from the table
@@ -116,24 +224,41 @@ bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false; // If table is empty, return false.
 
     // Find the entry so we can delete it
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int index = findSlot(table, key);
+    if (index < 0) return false;
+
+    /*
+      A probe only walks past a slot if the 16-slot group it was looking at had no empty slots.
+      If every 16-slot window containing this slot has an empty slot in it, no probe ever walked past it,
+      so it can go back to being empty instead of becoming a tombstone. This stops probe chains from growing forever with churn.
+    */
+    int mask = table->capacity - 1;
+    BitMask emptyBefore = matchByte(&table->control[(index - GROUP_WIDTH) & mask], CTRL_EMPTY);
+    BitMask emptyAfter = matchByte(&table->control[index], CTRL_EMPTY);
+    bool wasNeverFull = emptyBefore != 0 && emptyAfter != 0 &&
+        trailingZeros(emptyAfter) + leadingZeros(emptyBefore) < GROUP_WIDTH;
 
-    // Place a tombstone (special entry so findEntry doesn't stop when probing, since it also finds empty buckets for new entries) to delete the entry
-    entry->key == NULL;
-    entry->value = BOOL_VAL(true);
+    if (wasNeverFull) {
+        setControl(table, index, CTRL_EMPTY);
+    } else {
+        setControl(table, index, CTRL_DELETED);
+        table->tombstones++;
+    }
+
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
+    table->count--;
+    return true;
 }
 
 // Adds all entries from one table to another.
-void tableAddAll(Table* from, Table* to) {
+void tableAddAll(VM* vm, Table* from, Table* to) {
     // Loop capacity of "from" table times
     for (int i = 0; i < from->capacity; i++) {
-        // Get entry at index i
-        Entry* entry = &from->entries[i];
-
         // Add entry to "to" table
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+        if (isFull(from->control[i])) {
+            Entry* entry = &from->entries[i];
+            tableSet(vm, to, entry->key, entry->value);
         }
     }
 }
@@ -142,19 +267,32 @@ void tableAddAll(Table* from, Table* to) {
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL; // If table is empty, return null
 
-    uint32_t index = hash % table->capacity; // Map entry to an index using key hash modulus capacity (basically folds the range on itself so it can fit in the array)
-    
-    // Probing loop. Load factor prevents infinite loop (since there will always be space, the return statement will always be accessible)
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-            // We found the string!
-            return entry->key;
+    int mask = table->capacity - 1;
+    uint8_t h2 = H2(hash);
+    int position = H1(hash) & mask;
+
+    // Same probing as findSlot(), except keys are compared by their characters instead of by pointer
+    for (int step = GROUP_WIDTH;; step += GROUP_WIDTH) {
+        const uint8_t* group = &table->control[position];
+
+        for (BitMask match = matchByte(group, h2); match != 0; match &= match - 1) {
+            ObjString* key = table->entries[(position + trailingZeros(match)) & mask].key;
+            if (key->hash == hash && key->length == length && memcmp(key->chars, chars, length) == 0) {
+                // We found the string!
+                return key;
+            }
         }
 
-        index = (index + 1) % table->capacity; // Wrap around if we didnt find it.
+        if (matchByte(group, CTRL_EMPTY) != 0) return NULL; // Stop if the group has an empty slot
+        position = (position + step) & mask;
+    }
+}
+
+// Deletes every entry whose key wasn't marked by the garbage collector. Used to make the intern table weak.
+void tableRemoveWhite(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        if (isFull(table->control[i]) && !table->entries[i].key->obj.isMarked) {
+            tableDelete(table, table->entries[i].key);
+        }
     }
 }
\ No newline at end of file
@@ -10,17 +10,20 @@ typedef struct {
 } Entry;
 
 typedef struct {
-    int count; // Number of pairs currently stored
-    int capacity;
+    int count;      // Number of pairs currently stored
+    int tombstones; // Number of deleted slots that still have to be probed past
+    int capacity;   // Always 0 or a power of two
+    uint8_t* control; // One control byte per entry, saying if it's empty, deleted, or full (and 7 bits of the key's hash if it's full)
     Entry* entries;
 } Table;
 
 void initTable(Table* table);
-void freeTable(Table* table);
+void freeTable(VM* vm, Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
-bool tableSet(Table* table, ObjString* key, Value value);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
-void tableAddAll(Table* from, Table* to);
+void tableAddAll(VM* vm, Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
+void tableRemoveWhite(Table* table);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "vm.h"
+
+/*
+  loadImage() has to turn away any image whose code would make run() read or write somewhere it shouldn't. This compiles a few programs,
+  writes them out as images, damages each one a byte at a time in the ways a broken or hostile file could, and checks that the damaged
+  images don't load while the untouched ones still do.
+*/
+
+// The start of ImageHeader in image.c. Only the fields this needs, which is everything up to codeOffset.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t codeCount;
+    uint32_t lineCount;
+    uint32_t constantCount;
+    uint32_t maxStack;
+    uint32_t codeOffset;
+} Header;
+
+#define IMAGE_PATH "tests/damaged.loxc"
+
+static VM vm;
+static int checks = 0;
+static int failures = 0;
+
+static uint8_t* readImage(size_t* size) {
+    FILE* file = fopen(IMAGE_PATH, "rb");
+    if (file == NULL) exit(74);
+    fseek(file, 0L, SEEK_END);
+    *size = (size_t)ftell(file);
+    rewind(file);
+    uint8_t* image = (uint8_t*)malloc(*size);
+    if (image == NULL || fread(image, 1, *size, file) < *size) exit(74);
+    fclose(file);
+    return image;
+}
+
+static void writeBytes(const uint8_t* image, size_t size) {
+    FILE* file = fopen(IMAGE_PATH, "wb");
+    if (file == NULL || fwrite(image, 1, size, file) < size) exit(74);
+    fclose(file);
+}
+
+static void expectLoad(const char* what, bool loads) {
+    checks++;
+    Program* program = loadImage(&vm, IMAGE_PATH);
+    if ((program != NULL) != loads) {
+        fprintf(stderr, "FAIL %s: %s\n", what, loads ? "didn't load" : "loaded anyway");
+        failures++;
+    }
+    if (program != NULL) freeProgram(&vm, program);
+}
+
+/*
+  Compiles "source" to an image and then, for each damage, sets the code byte at "offset" (negative counts back from the end) to "value"
+  and expects the load to fail. A maxStack of -1 leaves it alone, anything else replaces it.
+*/
+typedef struct {
+    const char* what;
+    int offset;
+    uint8_t value;
+    int maxStack;
+} Damage;
+
+static void checkDamage(const char* source, const Damage* damages, int count) {
+    Program* program = prepare(&vm, source);
+    if (program == NULL || !writeImage(&program->chunk, IMAGE_PATH)) {
+        fprintf(stderr, "Could not write an image of \"%s\".\n", source);
+        exit(70);
+    }
+    freeProgram(&vm, program);
+    expectLoad(source, true);
+
+    size_t size;
+    uint8_t* original = readImage(&size);
+    Header header;
+    memcpy(&header, original, sizeof(Header));
+    uint8_t* damaged = (uint8_t*)malloc(size);
+    if (damaged == NULL) exit(1);
+
+    for (int i = 0; i < count; i++) {
+        memcpy(damaged, original, size);
+        if (damages[i].maxStack >= 0) {
+            Header changed = header;
+            changed.maxStack = (uint32_t)damages[i].maxStack;
+            memcpy(damaged, &changed, sizeof(Header));
+        } else {
+            int offset = damages[i].offset < 0 ? (int)header.codeCount + damages[i].offset : damages[i].offset;
+            damaged[header.codeOffset + offset] = damages[i].value;
+        }
+        writeBytes(damaged, size);
+
+        char what[128];
+        snprintf(what, sizeof(what), "%s (%s)", source, damages[i].what);
+        expectLoad(what, false);
+    }
+
+    free(damaged);
+    free(original);
+}
+
+int main(void) {
+    initVM(&vm);
+
+    // OP_CONSTANT 0, OP_NEGATE, OP_RETURN. The negation fails at runtime, which is fine, since the image itself is valid.
+    static const Damage negate[] = {
+        { "constant index past the pool", 1, 200, -1 },
+        { "unknown opcode", 0, 0x20, -1 },
+        { "opcode past the last one", 0, 0xFF, -1 },
+        { "operand past the end of the code", -1, OP_CONSTANT, -1 },
+        { "no OP_RETURN", -1, OP_NOT, -1 },
+        { "OP_RETURN with nothing on the stack", 0, OP_RETURN, -1 },
+        { "OP_RETURN before the end", 2, OP_RETURN, -1 },
+        { "maxStack too small", 0, 0, 0 },
+        { "maxStack one too big", 0, 0, 2 },
+        { "maxStack far too large", 0, 0, 0x7FFFFFF0 },
+    };
+    checkDamage("-\"x\"", negate, (int)(sizeof(negate) / sizeof(negate[0])));
+
+    // The negation stops "b" from folding into "a", so the first three operands become an OP_CONCAT 3, with its operand at offset 8
+    static const Damage concat[] = {
+        { "OP_CONCAT of nothing", 8, 0, -1 },
+        { "OP_CONCAT of one", 8, 1, -1 },
+        { "OP_CONCAT of more than the stack holds", 8, 200, -1 },
+        { "maxStack too small", 0, 0, 2 },
+        { "maxStack far too large", 0, 0, 0x20000000 },
+    };
+    checkDamage("\"a\" + -\"b\" + \"c\" + -\"d\"", concat, (int)(sizeof(concat) / sizeof(concat[0])));
+
+    freeVM(&vm);
+    remove(IMAGE_PATH);
+    fprintf(stderr, "image: %d checks, %d failures\n", checks, failures);
+    return failures == 0 ? 0 : 1;
+}
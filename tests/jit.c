@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+/*
+  Differential test for the JIT: every program has to print exactly the same thing (stdout, stderr, and how the run ended) whether
+  it runs in run() or as machine code. For each program, one VM prepares it and runs it once, which is always run(), since a program
+  is only compiled once it's been run JIT_THRESHOLD times. A second VM runs the same program past the threshold, and every one of
+  those runs is compared against the first. The program also has to actually have been compiled by then, or the test is just
+  comparing run() with itself.
+
+  The programs are every file given on the command line (one program per line for .txt files, the whole file otherwise) plus
+  RANDOM_PROGRAMS generated ones. Build with NO_CONSTANT_FOLDING (see "make test-jit"), or most of them fold down to one constant.
+
+  Usage: jit [files...]
+*/
+#ifndef JIT_ENABLED
+#error "tests/jit.c needs the JIT: build with -DJIT -DNO_DEBUG_HOOKS on x86-64"
+#endif
+
+#define RANDOM_PROGRAMS 1000
+#define MAX_OUTPUT (64 * 1024)
+
+static int programs = 0;
+static int failures = 0;
+
+// ---- Capturing what a run prints ----
+
+static FILE* capture; // Both stdout and stderr are pointed at this while a program runs
+static int savedStdout;
+static int savedStderr;
+
+static void startCapture(void) {
+    fflush(stdout);
+    fflush(stderr);
+    rewind(capture);
+    if (ftruncate(fileno(capture), 0) != 0) exit(74);
+    savedStdout = dup(STDOUT_FILENO);
+    savedStderr = dup(STDERR_FILENO);
+    dup2(fileno(capture), STDOUT_FILENO);
+    dup2(fileno(capture), STDERR_FILENO);
+}
+
+// Stops capturing and writes what was printed into "output", followed by how the run ended
+static void endCapture(InterpretResult result, char* output) {
+    fflush(stdout);
+    fflush(stderr);
+    dup2(savedStdout, STDOUT_FILENO);
+    dup2(savedStderr, STDERR_FILENO);
+    close(savedStdout);
+    close(savedStderr);
+
+    rewind(capture);
+    size_t length = fread(output, 1, MAX_OUTPUT - 32, capture);
+    output[length] = '\0';
+
+    // printf shows a NaN's sign bit, and 0/0 comes out of the FPU with it set while machine code that builds NaNs differently doesn't.
+    // It's the same NaN as far as Lox can tell, so the sign is dropped.
+    char* nan;
+    while ((nan = strstr(output, "-nan")) != NULL) memmove(nan, nan + 1, strlen(nan));
+
+    sprintf(output + strlen(output), "[result %d]", (int)result);
+}
+
+// ---- Running one program both ways ----
+
+static void report(const char* name, const char* source, const char* message, const char* expected, const char* got) {
+    failures++;
+    if (failures > 20) return; // One bug tends to fail hundreds of programs, and the first few say all there is to say
+    fprintf(stderr, "FAIL %s: %s\n  source: %s\n", name, message, source);
+    if (expected != NULL) fprintf(stderr, "  run():  %s\n  JIT:    %s\n", expected, got);
+}
+
+static void checkProgram(const char* name, const char* source) {
+    static char expected[MAX_OUTPUT];
+    static char got[MAX_OUTPUT];
+    programs++;
+
+    // The reference run, in run()
+    VM vm;
+    initVM(&vm);
+    startCapture();
+    Program* program = prepare(&vm, source);
+    InterpretResult result = program == NULL ? INTERPRET_COMPILE_ERROR : runProgram(&vm, program);
+    endCapture(result, expected);
+    if (program != NULL) freeProgram(&vm, program);
+    freeVM(&vm);
+    if (result == INTERPRET_COMPILE_ERROR) return; // Same compiler either way, so there's nothing for the JIT to get wrong
+
+    initVM(&vm);
+    program = prepare(&vm, source);
+    for (int run = 1; run <= JIT_THRESHOLD + 1; run++) {
+        startCapture();
+        result = runProgram(&vm, program);
+        endCapture(result, got);
+        if (strcmp(expected, got) != 0) {
+            char message[64];
+            snprintf(message, sizeof(message), "run %d printed something else", run);
+            report(name, source, message, expected, got);
+            break;
+        }
+    }
+    if (program->jit.code == NULL) report(name, source, "the JIT didn't compile it", NULL, NULL);
+    freeProgram(&vm, program);
+    freeVM(&vm);
+}
+
+// ---- The corpus ----
+
+static char* readFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+    fseek(file, 0L, SEEK_END);
+    size_t size = (size_t)ftell(file);
+    rewind(file);
+    char* buffer = (char*)malloc(size + 1);
+    if (buffer == NULL || fread(buffer, 1, size, file) < size) exit(74);
+    buffer[size] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+static void checkFile(const char* path) {
+    char* source = readFile(path);
+    size_t length = strlen(path);
+    if (length < 4 || strcmp(path + length - 4, ".txt") != 0) {
+        checkProgram(path, source);
+        free(source);
+        return;
+    }
+
+    // One program per line
+    int line = 1;
+    for (char* start = source; *start != '\0'; line++) {
+        char* end = strchr(start, '\n');
+        if (end != NULL) *end = '\0';
+        if (*start != '\0') {
+            char name[512];
+            snprintf(name, sizeof(name), "%s:%d", path, line);
+            checkProgram(name, start);
+        }
+        if (end == NULL) break;
+        start = end + 1;
+    }
+    free(source);
+}
+
+// ---- Random programs ----
+
+/*
+  Random expressions over numbers, strings and booleans, mixed together the way real code wouldn't be, so both the fast paths and
+  every runtime error get hit. NaN, infinity and -0 are in there on purpose. So are newlines between tokens, so errors have to
+  report the right line.
+*/
+typedef struct {
+    char* text;
+    int length;
+    int capacity;
+    uint64_t state;
+} Generator;
+
+static uint32_t randomInt(Generator* generator, uint32_t bound) {
+    // xorshift64*
+    generator->state ^= generator->state >> 12;
+    generator->state ^= generator->state << 25;
+    generator->state ^= generator->state >> 27;
+    return (uint32_t)((generator->state * 0x2545F4914F6CDD1DULL) >> 32) % bound;
+}
+
+static void append(Generator* generator, const char* text) {
+    int length = (int)strlen(text);
+    if (generator->length + length + 1 > generator->capacity) {
+        generator->capacity = (generator->capacity + length + 1) * 2;
+        generator->text = (char*)realloc(generator->text, (size_t)generator->capacity);
+        if (generator->text == NULL) exit(1);
+    }
+    memcpy(generator->text + generator->length, text, (size_t)length + 1);
+    generator->length += length;
+}
+
+static void appendSpace(Generator* generator) {
+    append(generator, randomInt(generator, 20) == 0 ? "\n" : " ");
+}
+
+static const char* numbers[] = { "1", "2", "0", "-0", "3.5", "0.1", "1000000", "(0/0)", "(1/0)", "7", "100" };
+static const char* strings[] = { "\"a\"", "\"b\"", "\"ab\"", "\"0123456789012345678901234567890123456789\"", "\"\"" };
+static const char* literals[] = { "true", "false", "nil" };
+static const char* arithmetic[] = { "+", "-", "*", "/" };
+static const char* comparisons[] = { "<", ">", "<=", ">=", "==", "!=" };
+static const char* equalities[] = { "==", "!=" };
+#define PICK(generator, array) ((array)[randomInt(generator, sizeof(array) / sizeof((array)[0]))])
+
+static void generateBoolean(Generator* generator, int depth);
+
+static void generateNumber(Generator* generator, int depth) {
+    uint32_t roll = randomInt(generator, 100);
+    if (depth == 0 || roll < 20) {
+        append(generator, PICK(generator, numbers));
+    } else if (roll < 28) {
+        append(generator, "-");
+        generateNumber(generator, depth - 1);
+    } else if (roll < 31) {
+        append(generator, "\"oops\""); // Not a number, so the arithmetic around it fails
+    } else {
+        append(generator, "(");
+        generateNumber(generator, depth - 1);
+        appendSpace(generator);
+        append(generator, PICK(generator, arithmetic));
+        appendSpace(generator);
+        generateNumber(generator, depth - 1);
+        append(generator, ")");
+    }
+}
+
+static void generateString(Generator* generator, int depth) {
+    if (depth == 0 || randomInt(generator, 100) < 30) {
+        append(generator, PICK(generator, strings));
+        return;
+    }
+    append(generator, "(");
+    generateString(generator, depth - 1);
+    append(generator, " + ");
+    generateString(generator, depth - 1);
+    append(generator, ")");
+}
+
+static void generateBoolean(Generator* generator, int depth) {
+    uint32_t roll = randomInt(generator, 100);
+    if (depth == 0 || roll < 15) {
+        append(generator, PICK(generator, literals));
+    } else if (roll < 50) {
+        append(generator, "(");
+        generateNumber(generator, depth - 1);
+        appendSpace(generator);
+        append(generator, PICK(generator, comparisons));
+        appendSpace(generator);
+        generateNumber(generator, depth - 1);
+        append(generator, ")");
+    } else if (roll < 67) {
+        append(generator, "(");
+        generateString(generator, depth - 1);
+        append(generator, " ");
+        append(generator, PICK(generator, equalities));
+        append(generator, " ");
+        generateString(generator, depth - 1);
+        append(generator, ")");
+    } else if (roll < 84) {
+        append(generator, "!");
+        generateBoolean(generator, depth - 1);
+    } else {
+        append(generator, "(");
+        generateBoolean(generator, depth - 1);
+        append(generator, " ");
+        append(generator, PICK(generator, equalities));
+        append(generator, " ");
+        generateBoolean(generator, depth - 1);
+        append(generator, ")");
+    }
+}
+
+static void checkRandomPrograms(void) {
+    Generator generator = { NULL, 0, 0, 0x9E3779B97F4A7C15ULL };
+    for (int i = 0; i < RANDOM_PROGRAMS; i++) {
+        generator.length = 0;
+        append(&generator, "");
+        switch (randomInt(&generator, 3)) {
+            case 0: generateNumber(&generator, 7); break;
+            case 1: generateString(&generator, 6); break;
+            default: generateBoolean(&generator, 6); break;
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "random program %d", i);
+        checkProgram(name, generator.text);
+    }
+    free(generator.text);
+}
+
+int main(int argc, char* argv[]) {
+    capture = tmpfile();
+    if (capture == NULL) {
+        fprintf(stderr, "Could not create a temporary file.\n");
+        return 74;
+    }
+
+    for (int i = 1; i < argc; i++) checkFile(argv[i]);
+    checkRandomPrograms();
+
+    fclose(capture);
+    fprintf(stderr, "jit: %d programs, %d failures\n", programs, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "scanner.h"
+
+/*
+  identifierType() finds keywords with a perfect hash on the first character, the last character and the length (see scanner.c), so
+  a word is only a keyword if it lands in a keyword's slot and then matches it exactly. This runs a lot of words through scanToken()
+  and checks each one comes back as the right keyword or as TOKEN_IDENTIFIER, against nothing cleverer than strcmp over the list:
+    - every keyword, and every word that misses one by a character: "an", "classy", "fo", "thiss" and friends, with a character
+      swapped, added or dropped anywhere, and with the case changed
+    - every word of one to four lowercase letters, which covers every slot in the table many times over
+*/
+
+typedef struct {
+    const char* name;
+    TokenType type;
+} Keyword;
+
+static const Keyword keywords[] = {
+    { "and", TOKEN_AND },       { "class", TOKEN_CLASS }, { "else", TOKEN_ELSE },     { "false", TOKEN_FALSE },
+    { "for", TOKEN_FOR },       { "fun", TOKEN_FUN },     { "if", TOKEN_IF },         { "nil", TOKEN_NIL },
+    { "or", TOKEN_OR },         { "print", TOKEN_PRINT }, { "return", TOKEN_RETURN }, { "super", TOKEN_SUPER },
+    { "this", TOKEN_THIS },     { "true", TOKEN_TRUE },   { "var", TOKEN_VAR },       { "while", TOKEN_WHILE },
+};
+#define KEYWORD_COUNT ((int)(sizeof(keywords) / sizeof(keywords[0])))
+
+// The near misses that tripped up hand-written keyword tries, on top of the ones generated below
+static const char* nearMisses[] = {
+    "an", "ands", "andd", "classy", "clas", "cls", "elsee", "els", "fo", "fort", "fals", "falsey", "fu", "funn", "funny", "i", "iff",
+    "ni", "nill", "o", "orr", "prin", "prints", "retur", "returned", "supe", "sup", "superr", "th", "thi", "thiss", "tru", "truee",
+    "va", "vars", "whil", "whiles", "_and", "and_", "class1", "f", "t", "v", "w",
+};
+
+// Identifier characters to swap in and add. Every kind the scanner treats differently: letters, digits and underscore.
+static const char characters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+
+static int checks = 0;
+static int failures = 0;
+
+static TokenType expectedType(const char* word) {
+    for (int i = 0; i < KEYWORD_COUNT; i++) {
+        if (strcmp(word, keywords[i].name) == 0) return keywords[i].type;
+    }
+    return TOKEN_IDENTIFIER;
+}
+
+static void check(const char* word) {
+    if (word[0] >= '0' && word[0] <= '9') return; // That's a number, not a word
+    checks++;
+    Scanner scanner;
+    initScanner(&scanner, word);
+    Token token = scanToken(&scanner);
+    TokenType expected = expectedType(word);
+    if (token.type != expected || token.length != (int)strlen(word) || scanToken(&scanner).type != TOKEN_EOF) {
+        // Only the first few, since a broken table fails thousands of words
+        if (failures < 20) fprintf(stderr, "FAIL \"%s\": got token type %d, length %d, expected %d\n", word, token.type, token.length, expected);
+        failures++;
+    }
+}
+
+// Every word that's one character away from "word": one swapped, one added, one dropped
+static void checkNeighbours(const char* word) {
+    char buffer[16];
+    int length = (int)strlen(word);
+    for (int position = 0; position <= length; position++) {
+        for (const char* c = characters; *c != '\0'; c++) {
+            if (position < length) {
+                strcpy(buffer, word);
+                buffer[position] = *c;
+                check(buffer);
+            }
+            memcpy(buffer, word, (size_t)position);
+            buffer[position] = *c;
+            strcpy(buffer + position + 1, word + position);
+            check(buffer);
+        }
+        if (position < length) {
+            memcpy(buffer, word, (size_t)position);
+            strcpy(buffer + position, word + position + 1);
+            if (buffer[0] != '\0') check(buffer);
+        }
+    }
+}
+
+static void checkCases(const char* word) {
+    char buffer[16];
+    strcpy(buffer, word);
+    buffer[0] = (char)(buffer[0] - 'a' + 'A');
+    check(buffer);
+    for (int i = 1; buffer[i] != '\0'; i++) buffer[i] = (char)(buffer[i] - 'a' + 'A'); // The first one already is
+    check(buffer);
+}
+
+// Every lowercase word of exactly "length" letters, built up in "word" from position "at"
+static void checkAllWords(char* word, int at, int length) {
+    if (at == length) {
+        word[at] = '\0';
+        check(word);
+        return;
+    }
+    for (char c = 'a'; c <= 'z'; c++) {
+        word[at] = c;
+        checkAllWords(word, at + 1, length);
+    }
+}
+
+int main(void) {
+    for (int i = 0; i < KEYWORD_COUNT; i++) {
+        check(keywords[i].name);
+        checkNeighbours(keywords[i].name);
+        checkCases(keywords[i].name);
+    }
+    for (size_t i = 0; i < sizeof(nearMisses) / sizeof(nearMisses[0]); i++) check(nearMisses[i]);
+
+    char word[8];
+    for (int length = 1; length <= 4; length++) checkAllWords(word, 0, length);
+
+    fprintf(stderr, "keywords: %d words, %d failures\n", checks, failures);
+    return failures == 0 ? 0 : 1;
+}
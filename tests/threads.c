@@ -0,0 +1,145 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+/*
+  Every VM is supposed to be completely separate from every other one, so any number of them can run on their own threads at once.
+  This runs THREADS threads, each with its own VM, compiling and running the same programs over and over, and checks every result
+  against what one VM on the main thread got. Built with -fsanitize=thread (see "make test-threads"), so a global or a static that
+  two VMs end up sharing shows up as a data race even when the results happen to come out right.
+
+  Programs print their results, and stdout is shared, so the printed values can't be told apart. What gets checked instead is how
+  each run ended (ok, compile error or runtime error), and for programs that make a string, that the string is interned in that
+  thread's VM. Each thread also has a program of its own, and at the end every VM is checked for the other threads' strings, which
+  it should never have seen.
+*/
+#define THREADS 8
+#define ROUNDS 200
+
+typedef struct {
+    const char* source;
+    const char* string; // The string the program evaluates to, or NULL if it doesn't make one
+} Case;
+
+static const Case cases[] = {
+    { "1 + 2 * 3 - 4 / (5 - 6)", NULL },
+    { "(1 + 2) * 3 - 4 / (5 - 6) > 7 == !(8 <= 9)", NULL },
+    { "\"price: \" + \"12\" + \" USD\"", "price: 12 USD" },
+    { "\"ab\" == \"a\" + \"b\"", NULL },
+    { "\"con\" + \"cat\" + \"en\" + \"ation\" + \" of \" + \"a few \" + \"strings\"", "concatenation of a few strings" },
+    { "\"same\" + \"\" == \"\" + \"same\"", NULL },
+    { "!nil == (0/0 != 0/0)", NULL },
+    { "-\"not a number\"", NULL },               // Runtime error
+    { "\"strings and \" + 1", NULL },             // Runtime error
+    { "1 < \"2\"", NULL },                        // Runtime error
+    { "1 +", NULL },                              // Compile error
+    { "(\"unclosed\"", NULL },                    // Compile error
+};
+#define CASE_COUNT ((int)(sizeof(cases) / sizeof(cases[0])))
+
+static InterpretResult expected[CASE_COUNT]; // What one VM on the main thread got for each case
+
+typedef struct {
+    int index;
+    VM vm;
+    Program* own; // Only this thread ever runs it, and it's kept alive until the end so its string stays interned
+    char ownString[32];
+    int failures;
+} Worker;
+
+static bool isInterned(VM* vm, const char* chars) {
+    int length = (int)strlen(chars);
+    return tableFindString(&vm->strings, chars, length, hashString(vm->hashSecret, chars, length)) != NULL;
+}
+
+/*
+  Reports go to the real stderr, and so do ThreadSanitizer's, straight to file descriptor 2. The stream the VMs print their errors to is swapped
+  for one that goes nowhere, since every failing case would fill the screen. (stderr is assignable on glibc and macOS, which is where TSan runs anyway.)
+*/
+static FILE* report;
+static pthread_mutex_t reportLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fail(Worker* worker, const char* message, const char* source) {
+    pthread_mutex_lock(&reportLock);
+    fprintf(report, "thread %d: %s: %s\n", worker->index, message, source);
+    pthread_mutex_unlock(&reportLock);
+    worker->failures++;
+}
+
+static void checkCase(Worker* worker, int i) {
+    InterpretResult result = interpret(&worker->vm, cases[i].source);
+    if (result != expected[i]) fail(worker, "wrong result", cases[i].source);
+    // Nothing allocates between the program printing its result and here, so the string can't have been collected yet
+    if (cases[i].string != NULL && !isInterned(&worker->vm, cases[i].string)) fail(worker, "result isn't interned", cases[i].source);
+}
+
+static void* work(void* argument) {
+    Worker* worker = (Worker*)argument;
+    initVM(&worker->vm);
+
+    char source[64];
+    snprintf(worker->ownString, sizeof(worker->ownString), "thread %d only", worker->index);
+    snprintf(source, sizeof(source), "\"thread \" + \"%d\" + \" only\"", worker->index);
+    worker->own = prepare(&worker->vm, source);
+    if (worker->own == NULL) {
+        fail(worker, "couldn't compile", source);
+        return NULL;
+    }
+
+    for (int round = 0; round < ROUNDS; round++) {
+        // Every thread goes through the cases in a different order, so they aren't all doing the same thing at the same time
+        for (int i = 0; i < CASE_COUNT; i++) checkCase(worker, (i + worker->index + round) % CASE_COUNT);
+        if (runProgram(&worker->vm, worker->own) != INTERPRET_OK) fail(worker, "own program failed", source);
+    }
+    return NULL;
+}
+
+int main(void) {
+    report = stderr;
+    FILE* nowhere = fopen("/dev/null", "w");
+    if (nowhere == NULL || freopen("/dev/null", "w", stdout) == NULL) return 74;
+    stderr = nowhere;
+
+    VM reference;
+    initVM(&reference);
+    for (int i = 0; i < CASE_COUNT; i++) expected[i] = interpret(&reference, cases[i].source);
+    freeVM(&reference);
+
+    static Worker workers[THREADS];
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        workers[i].index = i;
+        workers[i].own = NULL;
+        workers[i].failures = 0;
+        if (pthread_create(&threads[i], NULL, work, &workers[i]) != 0) {
+            fprintf(report, "Could not start thread %d.\n", i);
+            return 1;
+        }
+    }
+
+    int failures = 0;
+    for (int i = 0; i < THREADS; i++) pthread_join(threads[i], NULL);
+    for (int i = 0; i < THREADS; i++) {
+        // Joining the threads is what makes it safe to look at their VMs from here
+        for (int j = 0; j < THREADS; j++) {
+            if (isInterned(&workers[i].vm, workers[j].ownString) != (i == j)) {
+                fprintf(report, "thread %d: %s \"%s\"\n", i, i == j ? "lost its own string" : "has another thread's string", workers[j].ownString);
+                failures++;
+            }
+        }
+        failures += workers[i].failures;
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        if (workers[i].own != NULL) freeProgram(&workers[i].vm, workers[i].own);
+        freeVM(&workers[i].vm);
+    }
+
+    fprintf(report, "threads: %d threads x %d rounds x %d programs, %d failures\n", THREADS, ROUNDS, CASE_COUNT + 1, failures);
+    return failures == 0 ? 0 : 1;
+}
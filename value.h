@@ -5,6 +5,61 @@
 
 typedef struct Obj Obj; 
 typedef struct ObjString ObjString;
+typedef struct VM VM; // Defined in vm.h, which needs Value first
+
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+/*
+  NaN boxing! A double that is a quiet NaN only really uses a couple of its 64 bits, so the rest are free real estate.
+  Numbers are stored as plain doubles. Everything else is a quiet NaN with some extra bits set:
+    - nil, true and false put a small tag in the lowest bits.
+    - Obj pointers set the sign bit and stuff the pointer (which only uses 48 bits on x86-64 and ARM64) in the mantissa.
+  This makes a Value 8 bytes instead of 16, so the stack, constant pools and tables all shrink by half.
+*/
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL   1 // 01
+#define TAG_FALSE 2 // 10
+#define TAG_TRUE  3 // 11
+
+typedef uint64_t Value; // Represents a Lox value
+
+// These macros check the type of a Lox Value
+#define IS_BOOL(value)      (((value) | 1) == TRUE_VAL) // false is 10 and true is 11, so OR-ing with 1 turns false into true
+#define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_NUMBER(value)    (((value) & QNAN) != QNAN) // If any of the quiet NaN bits aren't set, its a real double
+#define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+// These macros unwrap a C value from a Lox Value of a specific type
+#define AS_BOOL(value)      ((value) == TRUE_VAL)
+#define AS_NUMBER(value)    valueToNum(value)
+#define AS_OBJ(value)       ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+// These macros create a Lox Value of a specific type
+#define BOOL_VAL(b)         ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(num)     numToValue(num)
+#define OBJ_VAL(obj)        (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+// memcpy is the well-defined way to reinterpret the bits of a double. Compilers turn it into a single move.
+static inline double valueToNum(Value value) {
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num) {
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
 
 typedef enum {
     VAL_BOOL,
@@ -39,6 +94,8 @@ typedef struct {
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 
+#endif
+
 typedef struct {
     int capacity;
     int count;
@@ -47,8 +104,8 @@ typedef struct {
 
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
-void writeValueArray(ValueArray* array, Value value);
-void freeValueArray(ValueArray* array);
+void writeValueArray(VM* vm, ValueArray* array, Value value);
+void freeValueArray(VM* vm, ValueArray* array);
 void printValue(Value value);
 
 #endif
\ No newline at end of file
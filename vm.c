@@ -1,21 +1,37 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "hash.h"
+#include "image.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
+#include "profile.h"
 #include "vm.h"
 
-VM vm;
+static void resetStack(VM* vm) {
+    vm->stackTop = vm->stack;
+}
+
+// Makes sure the stack has room for "needed" values. Only called while the stack is empty, so nothing on it has to survive the move.
+static void ensureStack(VM* vm, int needed) {
+    if (needed <= vm->stackCapacity) return;
+
+    int oldCapacity = vm->stackCapacity;
+    int capacity = oldCapacity;
+    while (capacity < needed) capacity = GROW_CAPACITY(capacity);
 
-static void resetStack() {
-    vm.stackTop = vm.stack;
+    vm->stack = GROW_ARRAY(vm, MEM_STACK, Value, vm->stack, oldCapacity, capacity);
+    vm->stackCapacity = capacity;
+    resetStack(vm);
 }
 
-static void runtimeError(const char* format, ...) {
+void runtimeError(VM* vm, const char* format, ...) {
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
@@ -23,170 +39,796 @@ static void runtimeError(const char* format, ...) {
     fputs("\n", stderr);
 
     // Current instruction index minus 1, because interpreter advances past an instruction before execution
-    size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instruction];
+    size_t instruction = vm->ip - vm->chunk->code - 1;
+    int line = getLine(vm->chunk, (int)instruction);
     fprintf(stderr, "[line %d] in script\n", line);
-    resetStack();
+    resetStack(vm);
 }
 
-void initVM() {
-    resetStack();
-    vm.objects = NULL;
-    initTable(&vm.strings); // Interned string table
+void initVM(VM* vm) {
+#ifdef POOL_ALLOCATOR
+    initPool(&vm->pool); // Before anything gets allocated
+#endif
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+    resetStack(vm);
+    vm->chunk = NULL;
+    vm->objects = NULL;
+    vm->programs = NULL;
+    vm->compiler = NULL;
+
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024; // First collection happens at 1 MB
+    vm->totalBytesAllocated = 0;
+    vm->totalBytesFreed = 0;
+    vm->peakBytes = 0;
+    memset(vm->memory, 0, sizeof(vm->memory));
+    vm->gcCount = 0;
+    vm->gcPauseSeconds = 0;
+
+#ifdef DEBUG_COUNT_OPCODE_PAIRS
+    vm->opcodePairs = (OpcodePairs*)calloc(1, sizeof(OpcodePairs)); // Plain calloc, so the counters aren't part of the GC's heap
+    if (vm->opcodePairs == NULL) exit(1);
+#endif
+#ifdef DEBUG_PROFILE
+    initProfiler(&vm->profiler);
+#endif
+
+    seedHash(vm->hashSecret); // Before any strings get made
+    initTable(&vm->strings); // Interned string table
+
+    // The compiler pushes constants while it adds them to the pool (see addConstant()), so there has to be a stack before anything runs
+    ensureStack(vm, STACK_INITIAL);
 }
 
-void freeVM() {
-    freeTable(&vm.strings); 
-    freeObjects();
+void freeVM(VM* vm) {
+    // Free any programs the embedder forgot about
+    while (vm->programs != NULL) {
+        freeProgram(vm, vm->programs);
+    }
+
+    freeTable(vm, &vm->strings); 
+    freeObjects(vm);
+    FREE_ARRAY(vm, MEM_STACK, Value, vm->stack, vm->stackCapacity);
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+    resetStack(vm);
+#ifdef POOL_ALLOCATOR
+    freePool(&vm->pool); // Everything that came out of it has been freed by now
+#endif
+
+#ifdef DEBUG_COUNT_OPCODE_PAIRS
+    printOpcodePairs(vm->opcodePairs);
+    free(vm->opcodePairs);
+    vm->opcodePairs = NULL;
+#endif
+
+#ifdef DEBUG_PROFILE
+    writeProfile(&vm->profiler);
+#endif
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc stats: %d collections, %.3f ms paused, %zu bytes allocated, %zu bytes freed\n",
+        vm->gcCount, vm->gcPauseSeconds * 1000, vm->totalBytesAllocated, vm->totalBytesFreed);
+#endif
 }
 
-void push(Value value) {
-    *vm.stackTop = value;
-    vm.stackTop++;
+void push(VM* vm, Value value) {
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
-Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+Value pop(VM* vm) {
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
 // Returns a Value from the stack without popping it
-static Value peek(int distance) {
+static Value peek(VM* vm, int distance) {
     // stackTop is a pointer to the top of the stack, so this is doing pointer math to find values
-    return vm.stackTop[-1 - distance];
+    return vm->stackTop[-1 - distance];
 }
 
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
+static void concatenate(VM* vm) {
+    // Peek instead of pop, so the operands stay reachable if allocating the result triggers a collection
+    Obj* result = concatenateStrings(vm, AS_OBJ(peek(vm, 1)), AS_OBJ(peek(vm, 0)));
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(result));
+}
 
-    // Calculate length of new string
-    int length = a->length + b->length;
+/*
+  OP_CONCAT with operands that aren't all strings. This does exactly what the chain of OP_ADDs would have, one pair at a time, including
+  failing on the first pair that can't be added. The running total lives in the first operand's slot, so nothing leaves the stack (or the GC's sight) until the end.
+*/
+static bool addOneByOne(VM* vm, Value* operands, int count) {
+    for (int i = 1; i < count; i++) {
+        if (IS_NUMBER(operands[0]) && IS_NUMBER(operands[i])) {
+            operands[0] = NUMBER_VAL(AS_NUMBER(operands[0]) + AS_NUMBER(operands[i]));
+        } else if (IS_ANY_STRING(operands[0]) && IS_ANY_STRING(operands[i])) {
+            operands[0] = OBJ_VAL(concatenateStrings(vm, AS_OBJ(operands[0]), AS_OBJ(operands[i])));
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
 
-    // Allocate new string
-    char* chars = ALLOCATE(char, length + 1);
+// Adds up "count" values left to right, and leaves the total where the first one was. They have to be somewhere the GC marks (the stack, or the registers).
+static bool addValues(VM* vm, Value* operands, int count) {
+    // The types are checked once up front. If they're all strings, the result is built in one go, without the strings in between.
+    bool allStrings = true;
+    for (int i = 0; i < count; i++) {
+        if (!IS_ANY_STRING(operands[i])) {
+            allStrings = false;
+            break;
+        }
+    }
 
-    // Copy chars to new stirng (in the right order)
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
+    if (allStrings) {
+        ObjString* result = concatenateAll(vm, operands, count); // The operands are still where the GC can see them while this allocates
+        operands[0] = OBJ_VAL(result);
+        return true;
+    }
+    return addOneByOne(vm, operands, count);
+}
 
-    // Add null terminator
-    chars[length] = '\0';
+// Adds up the top "count" values on the stack, left to right, and leaves the total in their place. Returns false if some pair can't be added.
+bool concatenateValues(VM* vm, int count) {
+    Value* operands = vm->stackTop - count;
+    if (!addValues(vm, operands, count)) return false;
+    vm->stackTop = operands + 1;
+    return true;
+}
 
-    // Wrap the string into an ObjString, then push it onto the stack
-    ObjString* result = takeString(chars, length);
-    push(OBJ_VAL(result));
+// Ropes have to be flattened into interned strings before they can be compared. That allocates, so it's done while they're still on the stack.
+static void flattenOperands(VM* vm) {
+    vm->stackTop[-1] = flattenValue(vm, peek(vm, 0));
+    vm->stackTop[-2] = flattenValue(vm, peek(vm, 1));
 }
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++) // The IP (instruction pointer) always points to the next byte of code.
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()]) // The bytecode array stores the index of a Value in the constant pool.
+static InterpretResult run(VM* vm) {
+    // The instruction pointer and stack top are cached in locals so the C compiler can keep them in registers, instead of re-reading them from the VM on every instruction.
+    uint8_t* ip = vm->ip;
+    Value* stackTop = vm->stackTop;
+    Value* constants = vm->chunk->constants.values;
+    /*
+      The value on top of the stack is cached in a local too. Nearly every instruction replaces the top with its result, and the next one
+      reads it right back, so keeping it out of memory saves a store and a load each time. Only the values under it are on the stack.
+      When the stack is empty, "top" holds a sentinel that the first push moves into the bottom slot. That way pushing never has to check
+      whether there's a real value to move down, and the stack still never holds more than maxStack values (the sentinel takes the top's place).
+    */
+    Value top = NIL_VAL;
+
+#define READ_BYTE() (*ip++) // The IP (instruction pointer) always points to the next byte of code.
+#define READ_CONSTANT() (constants[READ_BYTE()]) // The bytecode array stores the index of a Value in the constant pool.
+#define READ_CONSTANT_LONG() (ip += 3, constants[ip[-3] | (ip[-2] << 8) | (ip[-1] << 16)]) // 24-bit index, lowest byte first
+#define PUSH(value) (*stackTop++ = top, top = (value))
+#define SECOND() (stackTop[-1]) // The value right under the top
+#define POP_SECOND() (*--stackTop) // Takes the value under the top off the stack, for instructions that then replace the top with their result
+// Anything outside of run() (runtimeError(), concatenate(), the GC) reads vm->ip and vm->stackTop, so the locals have to be written back before
+// calling it. That includes spilling the top onto the stack, and reloading it afterwards in case it was changed or popped.
+#define STORE_FRAME() (vm->ip = ip, *stackTop = top, vm->stackTop = stackTop + 1)
+#define LOAD_FRAME() (ip = vm->ip, stackTop = vm->stackTop - 1, top = *stackTop)
+#define RUNTIME_ERROR(...) \
+    do { \
+        STORE_FRAME(); \
+        runtimeError(vm, __VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
 #define BINARY_OP(valueType, op) \
     do { \
         /* Binary operations are pushed onto the stack in this order: operator, left operand, right operand */ \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("Operands must be numbers."); \
+        if (!IS_NUMBER(top) || !IS_NUMBER(SECOND())) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        double b = AS_NUMBER(top); \
+        double a = AS_NUMBER(POP_SECOND()); \
+        top = valueType(a op b); \
+    } while (false)
+// >= and <= are compiled as the opposite comparison negated (which isn't the same thing when NaN is involved), so their superinstructions do exactly that
+#define NEGATED_COMPARISON(op) \
+    do { \
+        if (!IS_NUMBER(top) || !IS_NUMBER(SECOND())) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
+        double b = AS_NUMBER(top); \
+        double a = AS_NUMBER(POP_SECOND()); \
+        top = BOOL_VAL(!(a op b)); \
+    } while (false)
+#define FLATTEN_OPERANDS() \
+    do { \
+        if (IS_ROPE(top) || IS_ROPE(SECOND())) { \
+            STORE_FRAME(); \
+            flattenOperands(vm); \
+            LOAD_FRAME(); \
+        } \
+    } while (false)
+/*
+  Quickening. A generic instruction that has just run rewrites its own opcode (which is "length" bytes back, since ip has moved past its operands)
+  into a version that assumes the types it just saw. The assumption gets checked with one cheap guard, and when it fails, the quickened
+  instruction turns back into the generic one and runs that instead, from the top and with the same operands. The generic instruction is then
+  free to quicken again, so a site whose types change settles on whatever it saw last.
+  Only instructions with more than one thing to check are quickened. OP_SUBTRACT, OP_LESS, OP_NEGATE and the like can only ever work on
+  numbers, so their generic versions already are the specialized ones.
+*/
+#ifdef QUICKENING
+#define QUICKEN(length, opcode) do { ip[-(length)] = (opcode); } while (false)
+#else
+#define QUICKEN(length, opcode) do { } while (false)
+#endif
+// The instruction has already been traced, counted and profiled once, so it goes straight back in with REDISPATCH() instead of DISPATCH()
+#define DEOPTIMIZE(length, opcode) \
+    do { \
+        ip -= (length); \
+        *ip = (opcode); \
+        REDISPATCH(); \
+    } while (false)
+// Like BINARY_OP, but the right operand comes from the constant pool instead of the stack. The left operand is replaced in place.
+#define CONSTANT_OP(valueType, op, quickened) \
+    do { \
+        Value constant = READ_CONSTANT(); \
+        if (!IS_NUMBER(top) || !IS_NUMBER(constant)) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        top = valueType(AS_NUMBER(top) op AS_NUMBER(constant)); \
+        QUICKEN(2, quickened); \
+    } while (false)
+// The quickened CONSTANT_OP. A constant never changes, so only the operand on the stack needs checking.
+#define CONSTANT_OP_NUM(op, generic) \
+    do { \
+        Value constant = READ_CONSTANT(); \
+        if (!IS_NUMBER(top)) DEOPTIMIZE(2, generic); \
+        top = NUMBER_VAL(AS_NUMBER(top) op AS_NUMBER(constant)); \
     } while (false)
 
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
+#define TRACE_INSTRUCTION() \
+    do { \
+        printf("          "); \
+        for (Value* slot = vm->stack + 1; slot < stackTop; slot++) { /* The bottom slot is the sentinel */ \
+            printf("[ "); \
+            printValue(*slot); \
+            printf(" ]"); \
+        } \
+        if (stackTop > vm->stack) { \
+            printf("[ "); \
+            printValue(top); \
+            printf(" ]"); \
+        } \
+        printf("\n"); \
+        disassembleInstruction(vm->chunk, (int)(ip - vm->chunk->code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef DEBUG_COUNT_OPCODE_PAIRS
+    int previousOpcode = -1;
+#define COUNT_OPCODE_PAIR() \
+    do { \
+        if (previousOpcode >= 0) countOpcodePair(vm->opcodePairs, (uint8_t)previousOpcode, *ip); \
+        previousOpcode = *ip; \
+    } while (false)
+#else
+#define COUNT_OPCODE_PAIR() do { } while (false)
+#endif
+
+#ifdef DEBUG_PROFILE
+#define PROFILE_INSTRUCTION() profileInstruction(&vm->profiler, vm->chunk, ip)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // Threaded dispatch. Every handler jumps straight to the next one through this table, so there's no bounds check and each opcode gets its own indirect branch (which the CPU's branch predictor likes a lot more than one shared jump).
+    static void* dispatchTable[] = {
+        [OP_CONSTANT]               = &&TARGET_OP_CONSTANT,
+        [OP_CONSTANT_LONG]          = &&TARGET_OP_CONSTANT_LONG,
+        [OP_NIL]                    = &&TARGET_OP_NIL,
+        [OP_TRUE]                   = &&TARGET_OP_TRUE,
+        [OP_FALSE]                  = &&TARGET_OP_FALSE,
+        [OP_EQUAL]                  = &&TARGET_OP_EQUAL,
+        [OP_GREATER]                = &&TARGET_OP_GREATER,
+        [OP_LESS]                   = &&TARGET_OP_LESS,
+        [OP_ADD]                    = &&TARGET_OP_ADD,
+        [OP_SUBTRACT]               = &&TARGET_OP_SUBTRACT,
+        [OP_MULTIPLY]               = &&TARGET_OP_MULTIPLY,
+        [OP_DIVIDE]                 = &&TARGET_OP_DIVIDE,
+        [OP_NOT]                    = &&TARGET_OP_NOT,
+        [OP_NEGATE]                 = &&TARGET_OP_NEGATE,
+        [OP_RETURN]                 = &&TARGET_OP_RETURN,
+        [OP_NOT_EQUAL]              = &&TARGET_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL]          = &&TARGET_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL]             = &&TARGET_OP_LESS_EQUAL,
+        [OP_ADD_CONSTANT]           = &&TARGET_OP_ADD_CONSTANT,
+        [OP_SUBTRACT_CONSTANT]      = &&TARGET_OP_SUBTRACT_CONSTANT,
+        [OP_MULTIPLY_CONSTANT]      = &&TARGET_OP_MULTIPLY_CONSTANT,
+        [OP_DIVIDE_CONSTANT]        = &&TARGET_OP_DIVIDE_CONSTANT,
+        [OP_CONCAT]                 = &&TARGET_OP_CONCAT,
+        [OP_ADD_NUM]                = &&TARGET_OP_ADD_NUM,
+        [OP_ADD_STR]                = &&TARGET_OP_ADD_STR,
+        [OP_EQUAL_NUM]              = &&TARGET_OP_EQUAL_NUM,
+        [OP_NOT_EQUAL_NUM]          = &&TARGET_OP_NOT_EQUAL_NUM,
+        [OP_ADD_CONSTANT_NUM]       = &&TARGET_OP_ADD_CONSTANT_NUM,
+        [OP_SUBTRACT_CONSTANT_NUM]  = &&TARGET_OP_SUBTRACT_CONSTANT_NUM,
+        [OP_MULTIPLY_CONSTANT_NUM]  = &&TARGET_OP_MULTIPLY_CONSTANT_NUM,
+        [OP_DIVIDE_CONSTANT_NUM]    = &&TARGET_OP_DIVIDE_CONSTANT_NUM,
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define TARGET(opcode) TARGET_##opcode
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        COUNT_OPCODE_PAIR(); \
+        PROFILE_INSTRUCTION(); \
+        goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+// Runs the instruction at ip without the debug hooks, for an instruction that's being run again (see DEOPTIMIZE)
+#define REDISPATCH() goto *dispatchTable[READ_BYTE()]
+#else
+    // Portable fallback for compilers without labels-as-values
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_INSTRUCTION(); \
+        COUNT_OPCODE_PAIR(); \
+        PROFILE_INSTRUCTION(); \
+    redispatch: \
+        switch (READ_BYTE())
+#define TARGET(opcode) case opcode
+#define DISPATCH() goto loop
+#define REDISPATCH() goto redispatch
+#endif
+
+    INTERPRET_LOOP {
+        TARGET(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH();
         }
-        printf("\n");
-        disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
-#endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
+        TARGET(OP_CONSTANT_LONG): {
+            Value constant = READ_CONSTANT_LONG();
+            PUSH(constant);
+            DISPATCH();
+        }
+        TARGET(OP_NIL):   PUSH(NIL_VAL); DISPATCH();
+        TARGET(OP_TRUE):  PUSH(BOOL_VAL(true)); DISPATCH();
+        TARGET(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+        TARGET(OP_EQUAL): {
+            if (IS_NUMBER(top) && IS_NUMBER(SECOND())) QUICKEN(1, OP_EQUAL_NUM);
+            FLATTEN_OPERANDS();
+            Value b = top;
+            Value a = POP_SECOND();
+            top = BOOL_VAL(valuesEqual(a, b));
+            DISPATCH();
+        }
+        TARGET(OP_GREATER):  BINARY_OP(BOOL_VAL, >); DISPATCH();
+        TARGET(OP_LESS):     BINARY_OP(BOOL_VAL, <); DISPATCH();
+        TARGET(OP_ADD): {
+            // String concatenation
+            if (IS_ANY_STRING(top) && IS_ANY_STRING(SECOND())) {
+                STORE_FRAME();
+                concatenate(vm);
+                LOAD_FRAME();
+                QUICKEN(1, OP_ADD_STR);
+            // Number addition
+            } else if (IS_NUMBER(top) && IS_NUMBER(SECOND())) {
+                double b = AS_NUMBER(top);
+                double a = AS_NUMBER(POP_SECOND());
+                top = NUMBER_VAL(a + b);
+                QUICKEN(1, OP_ADD_NUM);
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+            DISPATCH();
+        }
+        TARGET(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        TARGET(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        TARGET(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        TARGET(OP_NOT):
+            // Operate on the top of the stack in place instead of popping and pushing it
+            top = BOOL_VAL(isFalsey(top));
+            DISPATCH();
+        TARGET(OP_NEGATE):
+            // Check if operand is a number
+            if (!IS_NUMBER(top)) {
+                RUNTIME_ERROR("Operand must be a number.");
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD: {
-                // String concatenation
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                // Number addition
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+
+            // Unwrap the Value, negate it, and then wrap it back up
+            top = NUMBER_VAL(-AS_NUMBER(top));
+            DISPATCH();
+        TARGET(OP_RETURN): {
+            printValue(top);
+            printf("\n");
+            vm->ip = ip;
+            vm->stackTop = stackTop - 1; // The result was the last thing on the stack, and the sentinel under it goes too
+            return INTERPRET_OK;
+        }
+        TARGET(OP_NOT_EQUAL): {
+            if (IS_NUMBER(top) && IS_NUMBER(SECOND())) QUICKEN(1, OP_NOT_EQUAL_NUM);
+            FLATTEN_OPERANDS();
+            Value b = top;
+            Value a = POP_SECOND();
+            top = BOOL_VAL(!valuesEqual(a, b));
+            DISPATCH();
+        }
+        TARGET(OP_GREATER_EQUAL): NEGATED_COMPARISON(<); DISPATCH();
+        TARGET(OP_LESS_EQUAL):    NEGATED_COMPARISON(>); DISPATCH();
+        TARGET(OP_ADD_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            if (IS_NUMBER(top) && IS_NUMBER(constant)) {
+                top = NUMBER_VAL(AS_NUMBER(top) + AS_NUMBER(constant));
+                QUICKEN(2, OP_ADD_CONSTANT_NUM);
+            } else if (IS_ANY_STRING(top) && IS_STRING(constant)) {
+                // Strings are rare enough here to just put the constant on the stack and share OP_ADD's path
+                PUSH(constant);
+                STORE_FRAME();
+                concatenate(vm);
+                LOAD_FRAME();
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT:
-                // Pop the bool, operate on it, then push it
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE: 
-                // Check if operand is a number  
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                // Unwrap the Value, negate it, and then wrap it back up
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-            case OP_RETURN: {
-                printValue(pop());
-                printf("\n");
-                return INTERPRET_OK;
+            DISPATCH();
+        }
+        TARGET(OP_SUBTRACT_CONSTANT): CONSTANT_OP(NUMBER_VAL, -, OP_SUBTRACT_CONSTANT_NUM); DISPATCH();
+        TARGET(OP_MULTIPLY_CONSTANT): CONSTANT_OP(NUMBER_VAL, *, OP_MULTIPLY_CONSTANT_NUM); DISPATCH();
+        TARGET(OP_DIVIDE_CONSTANT):   CONSTANT_OP(NUMBER_VAL, /, OP_DIVIDE_CONSTANT_NUM); DISPATCH();
+        TARGET(OP_CONCAT): {
+            int count = READ_BYTE();
+            STORE_FRAME();
+            if (!concatenateValues(vm, count)) {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        TARGET(OP_ADD_NUM): {
+            if (!IS_NUMBER(top) || !IS_NUMBER(SECOND())) DEOPTIMIZE(1, OP_ADD);
+            double b = AS_NUMBER(top);
+            double a = AS_NUMBER(POP_SECOND());
+            top = NUMBER_VAL(a + b);
+            DISPATCH();
+        }
+        TARGET(OP_ADD_STR):
+            if (!IS_ANY_STRING(top) || !IS_ANY_STRING(SECOND())) DEOPTIMIZE(1, OP_ADD);
+            STORE_FRAME();
+            concatenate(vm);
+            LOAD_FRAME();
+            DISPATCH();
+        TARGET(OP_EQUAL_NUM): {
+            // No ropes to flatten and no valuesEqual() call. Comparing the doubles is all there is to it (and it keeps NaN != NaN).
+            if (!IS_NUMBER(top) || !IS_NUMBER(SECOND())) DEOPTIMIZE(1, OP_EQUAL);
+            double b = AS_NUMBER(top);
+            double a = AS_NUMBER(POP_SECOND());
+            top = BOOL_VAL(a == b);
+            DISPATCH();
         }
+        TARGET(OP_NOT_EQUAL_NUM): {
+            if (!IS_NUMBER(top) || !IS_NUMBER(SECOND())) DEOPTIMIZE(1, OP_NOT_EQUAL);
+            double b = AS_NUMBER(top);
+            double a = AS_NUMBER(POP_SECOND());
+            top = BOOL_VAL(a != b);
+            DISPATCH();
+        }
+        TARGET(OP_ADD_CONSTANT_NUM):      CONSTANT_OP_NUM(+, OP_ADD_CONSTANT); DISPATCH();
+        TARGET(OP_SUBTRACT_CONSTANT_NUM): CONSTANT_OP_NUM(-, OP_SUBTRACT_CONSTANT); DISPATCH();
+        TARGET(OP_MULTIPLY_CONSTANT_NUM): CONSTANT_OP_NUM(*, OP_MULTIPLY_CONSTANT); DISPATCH();
+        TARGET(OP_DIVIDE_CONSTANT_NUM):   CONSTANT_OP_NUM(/, OP_DIVIDE_CONSTANT); DISPATCH();
     }
 
+    return INTERPRET_RUNTIME_ERROR; // Unreachable
+
 #undef READ_BYTE
 #undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef PUSH
+#undef SECOND
+#undef POP_SECOND
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef NEGATED_COMPARISON
+#undef FLATTEN_OPERANDS
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef CONSTANT_OP
+#undef CONSTANT_OP_NUM
+#undef TRACE_INSTRUCTION
+#undef COUNT_OPCODE_PAIR
+#undef PROFILE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef TARGET
+#undef DISPATCH
+#undef REDISPATCH
+}
+
+#ifdef REGISTER_VM_ENABLED
+// How many constants runRegisters() copies into the window after the registers. The rest are out of the operands' reach anyway.
+static int windowConstants(Chunk* chunk) {
+    int room = MAX_REGISTER_WINDOW - chunk->maxStack;
+    return chunk->constants.count < room ? chunk->constants.count : room;
 }
 
-// Prepare a chunk in the VM for execution
-InterpretResult interpret(const char* source) {
-    Chunk chunk;
-    initChunk(&chunk);
+/*
+  Runs the chunk's register code (see generateRegisterCode() in compiler.c). The window is the bottom of the stack: the registers, which
+  are the stack's slots, and then a copy of the constant pool, so reading an operand never has to check which of the two it is.
+  runProgram() has already made the stack big enough for both.
+*/
+static InterpretResult runRegisters(VM* vm) {
+    Chunk* chunk = vm->chunk;
+    RegisterInstruction* ip = chunk->registerCode;
+    RegisterInstruction* instruction; // The one that's running. ip has already moved past it.
+    Value* window = vm->stack;
+    Value* constants = chunk->constants.values;
+
+    // stackTop stays above the whole window for the run, so the GC marks every register, even ones that aren't in use yet, and anything
+    // pushed for a moment (like internString() does) goes above the constants. So the registers have to start out holding something markable.
+    for (int i = 0; i < chunk->maxStack; i++) window[i] = NIL_VAL;
+    int constantCount = windowConstants(chunk);
+    if (constantCount > 0) memcpy(window + chunk->maxStack, constants, constantCount * sizeof(Value)); // The pool is NULL when it's empty
+    vm->stackTop = window + chunk->maxStack + constantCount;
+
+// runtimeError() finds the line from vm->ip, so point it just past the stack instruction this one came from
+#define RUNTIME_ERROR(...) \
+    do { \
+        vm->ip = chunk->code + chunk->registerOrigins[instruction - chunk->registerCode] + 1; \
+        runtimeError(vm, __VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+#define BINARY_OP(valueType, op) \
+    do { \
+        Value left = window[instruction->b]; \
+        Value right = window[instruction->c]; \
+        if (!IS_NUMBER(left) || !IS_NUMBER(right)) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        window[instruction->a] = valueType(AS_NUMBER(left) op AS_NUMBER(right)); \
+    } while (false)
+#define NEGATED_COMPARISON(op) \
+    do { \
+        Value left = window[instruction->b]; \
+        Value right = window[instruction->c]; \
+        if (!IS_NUMBER(left) || !IS_NUMBER(right)) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        window[instruction->a] = BOOL_VAL(!(AS_NUMBER(left) op AS_NUMBER(right))); \
+    } while (false)
+// Constants are never ropes, so only a register can need flattening. The flat string replaces the rope there, where the GC can see it.
+#define FLATTEN_OPERAND(operand) \
+    do { \
+        if (IS_ROPE(window[(operand)])) window[(operand)] = flattenValue(vm, window[(operand)]); \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() \
+    do { \
+        printf("          "); \
+        for (int i = 0; i < chunk->maxStack; i++) { \
+            printf("[ "); \
+            printValue(window[i]); \
+            printf(" ]"); \
+        } \
+        printf("\n"); \
+        disassembleRegisterInstruction(chunk, (int)(ip - chunk->registerCode)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+        [ROP_LOADK]         = &&TARGET_ROP_LOADK,
+        [ROP_NIL]           = &&TARGET_ROP_NIL,
+        [ROP_TRUE]          = &&TARGET_ROP_TRUE,
+        [ROP_FALSE]         = &&TARGET_ROP_FALSE,
+        [ROP_EQUAL]         = &&TARGET_ROP_EQUAL,
+        [ROP_NOT_EQUAL]     = &&TARGET_ROP_NOT_EQUAL,
+        [ROP_GREATER]       = &&TARGET_ROP_GREATER,
+        [ROP_LESS]          = &&TARGET_ROP_LESS,
+        [ROP_GREATER_EQUAL] = &&TARGET_ROP_GREATER_EQUAL,
+        [ROP_LESS_EQUAL]    = &&TARGET_ROP_LESS_EQUAL,
+        [ROP_ADD]           = &&TARGET_ROP_ADD,
+        [ROP_SUBTRACT]      = &&TARGET_ROP_SUBTRACT,
+        [ROP_MULTIPLY]      = &&TARGET_ROP_MULTIPLY,
+        [ROP_DIVIDE]        = &&TARGET_ROP_DIVIDE,
+        [ROP_NOT]           = &&TARGET_ROP_NOT,
+        [ROP_NEGATE]        = &&TARGET_ROP_NEGATE,
+        [ROP_CONCAT]        = &&TARGET_ROP_CONCAT,
+        [ROP_RETURN]        = &&TARGET_ROP_RETURN,
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define TARGET(opcode) TARGET_##opcode
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        instruction = ip++; \
+        goto *dispatchTable[instruction->opcode]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_INSTRUCTION(); \
+        instruction = ip++; \
+        switch (instruction->opcode)
+#define TARGET(opcode) case opcode
+#define DISPATCH() goto loop
+#endif
 
-    if (!compile(source, &chunk)) { // If theres a compilation error
-        freeChunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
+    INTERPRET_LOOP {
+        TARGET(ROP_LOADK):
+            window[instruction->a] = constants[instruction->b | ((uint32_t)instruction->c << 16)];
+            DISPATCH();
+        TARGET(ROP_NIL):   window[instruction->a] = NIL_VAL; DISPATCH();
+        TARGET(ROP_TRUE):  window[instruction->a] = BOOL_VAL(true); DISPATCH();
+        TARGET(ROP_FALSE): window[instruction->a] = BOOL_VAL(false); DISPATCH();
+        TARGET(ROP_EQUAL):
+            FLATTEN_OPERAND(instruction->c);
+            FLATTEN_OPERAND(instruction->b);
+            window[instruction->a] = BOOL_VAL(valuesEqual(window[instruction->b], window[instruction->c]));
+            DISPATCH();
+        TARGET(ROP_NOT_EQUAL):
+            FLATTEN_OPERAND(instruction->c);
+            FLATTEN_OPERAND(instruction->b);
+            window[instruction->a] = BOOL_VAL(!valuesEqual(window[instruction->b], window[instruction->c]));
+            DISPATCH();
+        TARGET(ROP_GREATER):       BINARY_OP(BOOL_VAL, >); DISPATCH();
+        TARGET(ROP_LESS):          BINARY_OP(BOOL_VAL, <); DISPATCH();
+        TARGET(ROP_GREATER_EQUAL): NEGATED_COMPARISON(<); DISPATCH();
+        TARGET(ROP_LESS_EQUAL):    NEGATED_COMPARISON(>); DISPATCH();
+        TARGET(ROP_ADD): {
+            Value left = window[instruction->b];
+            Value right = window[instruction->c];
+            if (IS_NUMBER(left) && IS_NUMBER(right)) {
+                window[instruction->a] = NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right));
+            } else if (IS_ANY_STRING(left) && IS_ANY_STRING(right)) {
+                // Both operands stay in the window until the result replaces the left one, so they're safe if this collects
+                Obj* result = concatenateStrings(vm, AS_OBJ(left), AS_OBJ(right));
+                window[instruction->a] = OBJ_VAL(result);
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            DISPATCH();
+        }
+        TARGET(ROP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        TARGET(ROP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        TARGET(ROP_DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        TARGET(ROP_NOT):
+            window[instruction->a] = BOOL_VAL(isFalsey(window[instruction->b]));
+            DISPATCH();
+        TARGET(ROP_NEGATE): {
+            Value operand = window[instruction->b];
+            if (!IS_NUMBER(operand)) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            window[instruction->a] = NUMBER_VAL(-AS_NUMBER(operand));
+            DISPATCH();
+        }
+        TARGET(ROP_CONCAT):
+            if (!addValues(vm, &window[instruction->a], instruction->b)) {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            DISPATCH();
+        TARGET(ROP_RETURN):
+            printValue(window[instruction->b]);
+            printf("\n");
+            vm->stackTop = vm->stack;
+            return INTERPRET_OK;
+    }
+
+    return INTERPRET_RUNTIME_ERROR; // Unreachable
+
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef NEGATED_COMPARISON
+#undef FLATTEN_OPERAND
+#undef TRACE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef TARGET
+#undef DISPATCH
+}
+#endif
+
+// Picks how to run the chunk: as machine code if the JIT has compiled it, then as register code if there is any, and otherwise in run()
+static InterpretResult execute(VM* vm, Program* program) {
+#ifdef JIT_ENABLED
+    // Only tried once. If the JIT can't handle the chunk, it just keeps running the other way.
+    if (++program->runCount == JIT_THRESHOLD) compileJit(&program->chunk, &program->jit);
+    if (program->jit.code != NULL) return runJit(vm, &program->jit);
+#endif
+#ifdef REGISTER_VM_ENABLED
+    if (program->chunk.registerCode != NULL) return runRegisters(vm);
+#endif
+    (void)program; // Only the JIT and the register code need it
+    return run(vm); // Execute!
+}
+
+// Allocates an empty program. It's tracked right away, so its constants stay alive until it's freed.
+Program* newProgram(VM* vm) {
+    Program* program = ALLOCATE(vm, MEM_PROGRAMS, Program, 1);
+    initChunk(&program->chunk);
+    program->image = NULL;
+    program->imageSize = 0;
+    program->hasPendingStrings = false;
+#ifdef JIT_ENABLED
+    program->runCount = 0;
+    program->jit.code = NULL;
+    program->jit.size = 0;
+#endif
+
+    program->next = vm->programs;
+    vm->programs = program;
+    return program;
+}
+
+// Compiles source code into a program that can be run many times. Returns NULL if there's a compilation error.
+Program* prepare(VM* vm, const char* source) {
+    Program* program = newProgram(vm);
+
+    if (!compile(vm, source, &program->chunk)) { // If theres a compilation error
+        freeProgram(vm, program);
+        return NULL;
     }
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code; // VM's instruction pointer now points to the newest instruction
+    return program;
+}
+
+// Runs a prepared program from the start
+InterpretResult runProgram(VM* vm, Program* program) {
+    if (program->hasPendingStrings) resolveImageStrings(vm, program);
+
+    // Grow the stack once, up front, so push() and the instructions never need to check for overflow
+    resetStack(vm);
+    int needed = program->chunk.maxStack + STACK_RESERVE;
+#ifdef REGISTER_VM_ENABLED
+    if (program->chunk.registerCode != NULL) needed += windowConstants(&program->chunk);
+#endif
+    ensureStack(vm, needed);
 
-    InterpretResult result = run(); // Execute!
+    vm->chunk = &program->chunk;
+    vm->ip = vm->chunk->code; // VM's instruction pointer now points to the first instruction
 
-    freeChunk(&chunk); // Free chunk after its done executing
+    InterpretResult result = execute(vm, program);
+#ifdef DEBUG_PROFILE
+    profileStop(&vm->profiler);
+#endif
+    vm->chunk = NULL;
     return result;
 }
 
+void freeProgram(VM* vm, Program* program) {
+    // Unlink the program so the GC stops marking its constants
+    Program** link = &vm->programs;
+    while (*link != program) link = &(*link)->next;
+    *link = program->next;
+
+#ifdef JIT_ENABLED
+    freeJit(&program->jit);
+#endif
+    if (program->image != NULL) {
+        freeImage(vm, program); // The chunk's code belongs to the image, so freeChunk() can't be used
+    } else {
+        freeChunk(vm, &program->chunk);
+    }
+    FREE(vm, MEM_PROGRAMS, Program, program);
+}
 
+// Compiles and runs source code once
+InterpretResult interpret(VM* vm, const char* source) {
+    Program* program = prepare(vm, source);
+    if (program == NULL) return INTERPRET_COMPILE_ERROR;
 
+    InterpretResult result = runProgram(vm, program);
+    freeProgram(vm, program); // Free program after its done executing
+    return result;
+}
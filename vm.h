@@ -2,19 +2,75 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "debug.h"
+#include "hash.h"
+#include "jit.h"
+#include "memory.h"
+#include "pool.h"
+#include "profile.h"
 #include "table.h"
 #include "value.h"
 
-#define STACK_MAX 256
+#define STACK_INITIAL 256 // The stack starts out this big, and grows before running a chunk that needs more
+#define STACK_RESERVE 8 // Room above a chunk's maxStack for values the runtime pushes for a moment to keep them safe from the GC (like internString() does), plus the slot run() spills its cached top into
 
-typedef struct {
+// Source code compiled once, so it can be run as many times as we want without scanning and compiling it again
+typedef struct Program {
+    Chunk chunk; // The bytecode and its constant pool
+    struct Program* next; // Every live program is in a list, so the GC can mark their constants
+
+    // Only set if the program was loaded from a bytecode image (see image.c). The chunk's code and lines point into it.
+    uint8_t* image;
+    size_t imageSize;
+    bool hasPendingStrings; // String constants from the image that haven't been interned yet
+
+#ifdef JIT_ENABLED
+    int runCount; // Once this hits JIT_THRESHOLD the chunk gets compiled to machine code (see jit.c)
+    JitCode jit;
+#endif
+} Program;
+
+/*
+  Everything one interpreter needs. Nothing in clox is global, so a process can have as many VMs as it wants,
+  each on its own thread. Objects, strings and programs belong to the VM that made them and can't be shared with another one.
+*/
+struct VM {
     Chunk* chunk;
     uint8_t* ip; // Instruction Pointer
-    Value stack[STACK_MAX];
+    Value* stack; // Heap allocated, so it can grow. It's only ever resized between runs, never while a chunk is running.
+    int stackCapacity;
     Value* stackTop; // Always points to the element after the element last pushed onto the stack
     Table strings; // Interned strings
     Obj* objects;
-} VM;
+    Program* programs; // Programs that have been prepared but not freed yet
+    struct Compiler* compiler; // The compiler that's running, if there is one, so the GC can mark what it's still holding on to
+    uint64_t hashSecret[HASH_SECRET_WORDS]; // What this VM's strings are hashed with (see hash.c)
+#ifdef POOL_ALLOCATOR
+    Pool pool; // Where reallocate() gets small blocks from
+#endif
+
+    // Garbage collector state
+    int grayCount;
+    int grayCapacity;
+    Obj** grayStack; // Worklist of objects that are marked but haven't had their references traced yet
+    size_t bytesAllocated; // Live bytes on the heap
+    size_t nextGC; // When bytesAllocated crosses this, we collect
+
+    // Garbage collector counters
+    size_t totalBytesAllocated;
+    size_t totalBytesFreed;
+    size_t peakBytes; // The most bytesAllocated has ever been
+    CategoryStats memory[MEM_CATEGORY_COUNT]; // The same numbers, split up by what the memory's for (see memory.h)
+    int gcCount;
+    double gcPauseSeconds; // Total time spent inside collectGarbage()
+
+#ifdef DEBUG_COUNT_OPCODE_PAIRS
+    OpcodePairs* opcodePairs; // 512 KB of counters, so it's allocated separately
+#endif
+#ifdef DEBUG_PROFILE
+    Profiler profiler;
+#endif
+}; // No typedef because it was forward declared in value.h
 
 typedef enum {
     INTERPRET_OK,
@@ -22,12 +78,21 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+void initVM(VM* vm);
+void freeVM(VM* vm);
+Program* newProgram(VM* vm);
+Program* prepare(VM* vm, const char* source);
+InterpretResult runProgram(VM* vm, Program* program);
+void freeProgram(VM* vm, Program* program);
+InterpretResult interpret(VM* vm, const char* source);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
 
-void initVM();
-void freeVM();
-InterpretResult interpret(const char* source);
-void push(Value value);
-Value pop();
+// Shared by run() and the JIT's helpers, so machine code reports errors and adds values exactly the same way
+void runtimeError(VM* vm, const char* format, ...);
+bool concatenateValues(VM* vm, int count);
+#ifdef JIT_ENABLED
+InterpretResult runJit(VM* vm, JitCode* jit); // In jit.c
+#endif
 
 #endif
\ No newline at end of file